@@ -0,0 +1,145 @@
+#include "buffer_plan.h"
+
+#include <algorithm>
+#include <numeric>
+#include <string>
+
+
+using namespace std;
+
+
+  /*
+   *
+   * 	BufferPlan implementation
+   *
+   */
+
+
+  BufferPlan::BufferPlan(const ContractionOptimizer& cOp) : arenaSize(0), unsharedSize(0) {
+    vector<vector<compStep_t>> schedule;
+    schedule.reserve(cOp.getCompStepList().size());
+    for (const auto& aStep : cOp.getCompStepList())
+      schedule.push_back(vector<compStep_t>(1, aStep));
+    _assign(cOp, schedule);
+  }
+
+  BufferPlan::BufferPlan(const ContractionOptimizer& cOp,
+			 const std::vector<std::vector<compStep_t>>& schedule) :
+    	arenaSize(0), unsharedSize(0) {
+    _assign(cOp, schedule);
+  }
+
+
+  void BufferPlan::_assign(const ContractionOptimizer& cOp,
+			   const std::vector<std::vector<compStep_t>>& schedule) {
+    nDil = ContractionCost::getDilutionRange();
+    if (nDil == 0)
+      throw(std::string("Must set dilution range first."));
+
+      // views are not scheduled, they name their underlying tensor
+    map<uint, uint> viewMap;
+    for (const auto& aStep : cOp.getCompStepList())
+      if (ContractionOptimizer::getStepKind(std::get<0>(aStep)) == stepPermute)
+	viewMap[std::get<2>(aStep)] = std::get<1>(aStep).first;
+    auto resolveView = [&viewMap](uint tensId) {
+      auto vIt = viewMap.find(tensId);
+      return (vIt == viewMap.end()) ? tensId : vIt->second;
+    };
+
+      // life of every tensor formed by the schedule
+    size_t endPos = schedule.size();
+    for (size_t iPos = 0; iPos < endPos; ++iPos)
+      for (const auto& aStep : schedule[iPos]) {
+	if (ContractionOptimizer::getStepKind(std::get<0>(aStep)) == stepPermute) continue;
+
+	for (auto opId : {std::get<1>(aStep).first, std::get<1>(aStep).second}) {
+	  auto bIt = bufferMap.find(resolveView(opId));
+	  if (bIt != bufferMap.end()) bIt->second.lastUse = iPos;
+	}
+
+	  // an accumulation target is written at every one of its steps
+	uint newId = std::get<2>(aStep);
+	auto bIt = bufferMap.find(newId);
+	if (bIt == bufferMap.end())
+	  bufferMap.emplace(newId, buffer_t{cOp.getTensorRank(newId), 0, 0, iPos, iPos});
+	else
+	  bIt->second.lastUse = iPos;
+      }
+
+    for (auto vIt : viewMap) {
+      if (cOp.getTensorRank(vIt.first) > 0) continue;
+      bufferMap[vIt.first] = buffer_t{0, 0, 0, 0, endPos};
+      auto bIt = bufferMap.find(vIt.second);
+      if (bIt != bufferMap.end()) bIt->second.lastUse = endPos;
+    }
+    for (const auto& aDiag : cOp.getDiagramList())
+      for (auto rId : aDiag.getResultIdList()) {
+	auto bIt = bufferMap.find(rId);
+	if (bIt != bufferMap.end()) bIt->second.lastUse = endPos;
+      }
+
+      // sweep over the schedule: slots are released one position after
+      // their last use and handed out again last in, first out
+    vector<vector<uint>> birthList(endPos + 1), deathList(endPos + 1);
+    for (auto& bIt : bufferMap) {
+      birthList[bIt.second.firstUse].push_back(bIt.first);
+      if (bIt.second.lastUse < endPos)
+	deathList[bIt.second.lastUse + 1].push_back(bIt.first);
+    }
+
+    uint maxRank = 0;
+    for (auto& bIt : bufferMap)
+      maxRank = max(maxRank, bIt.second.rank);
+    nSlotList.assign(maxRank + 1, 0);
+    vector<vector<uint>> freeSlotList(maxRank + 1);
+
+    for (size_t iPos = 0; iPos <= endPos; ++iPos) {
+      for (auto tensId : deathList[iPos]) {
+	const buffer_t& aBuf = bufferMap.at(tensId);
+	freeSlotList[aBuf.rank].push_back(aBuf.slot);
+      }
+      for (auto tensId : birthList[iPos]) {
+	buffer_t& aBuf = bufferMap.at(tensId);
+	if (freeSlotList[aBuf.rank].empty())
+	  aBuf.slot = nSlotList[aBuf.rank]++;
+	else {
+	  aBuf.slot = freeSlotList[aBuf.rank].back();
+	  freeSlotList[aBuf.rank].pop_back();
+	}
+      }
+    }
+
+      // slots of the largest tensors first
+    vector<unsigned long> classSize(maxRank + 1, 1), classOffset(maxRank + 1, 0);
+    for (uint iR = 1; iR <= maxRank; ++iR)
+      classSize[iR] = classSize[iR-1]*nDil;
+    for (int iR = int(maxRank); iR >= 0; --iR) {
+      classOffset[iR] = arenaSize;
+      arenaSize += nSlotList[iR]*classSize[iR];
+    }
+
+    for (auto& bIt : bufferMap) {
+      buffer_t& aBuf = bIt.second;
+      aBuf.offset = classOffset[aBuf.rank] + aBuf.slot*classSize[aBuf.rank];
+      unsharedSize += classSize[aBuf.rank];
+    }
+  }
+
+
+  size_t BufferPlan::getNumSlots() const {
+    return std::accumulate(nSlotList.begin(), nSlotList.end(), size_t(0));
+  }
+
+  void BufferPlan::bind(double* arena, double** tens) const {
+    for (const auto& bIt : bufferMap)
+      tens[bIt.first] = arena + 2*bIt.second.offset;
+  }
+
+  void BufferPlan::writeCSV(std::ostream& out) const {
+    out << "tensor,rank,slot,offset,first_use,last_use\n";
+    for (const auto& bIt : bufferMap) {
+      const buffer_t& aBuf = bIt.second;
+      out << bIt.first << "," << aBuf.rank << "," << aBuf.slot << "," << aBuf.offset << ","
+	  << aBuf.firstUse << "," << aBuf.lastUse << "\n";
+    }
+  }
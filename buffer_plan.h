@@ -0,0 +1,75 @@
+#ifndef BUFFER_PLAN_H
+#define BUFFER_PLAN_H
+
+#include <map>
+#include <ostream>
+#include <vector>
+
+#include "contraction_optimizer.h"
+
+
+
+  // Assigns storage to the tensors formed by a tuned plan, in the manner of
+  // a register allocator. For a given schedule -- the steps of the plan in
+  // the order they are executed, steps at the same position running
+  // together -- every tensor lives from the step forming it to its last
+  // use as an operand. Tensors of the same rank form a size class with
+  // slots of Ndil^rank complex numbers, and a tensor takes the most
+  // recently freed slot of its class, or a new one if none is free. A slot
+  // becomes free only after the position of the last use, so that no step
+  // writes to storage it reads.
+  //
+  // All slots are laid out in one arena, whose size is that of the largest
+  // set of tensors live at the same time. Diagram results, scalar views and
+  // the tensors underlying scalar views stay live until the end. Permuted
+  // views of rank > 0 have no storage, their uses extend the life of the
+  // underlying tensor. Input tensors are not part of the arena.
+class BufferPlan {
+
+  public:
+    struct buffer_t {
+      uint rank;
+      uint slot;		// index among the slots of the same rank
+      unsigned long offset;	// in complex numbers from the start of the arena
+      size_t firstUse, lastUse;	// positions in the schedule
+    };
+
+  private:
+    unsigned int nDil;
+    std::map<uint, buffer_t> bufferMap;
+      // number of slots of every rank
+    std::vector<uint> nSlotList;
+    unsigned long arenaSize, unsharedSize;
+
+  public:
+      // the order of the plan, one step at a time, as in the driver
+      // function of CodeGenerator
+    BufferPlan(const ContractionOptimizer& cOp);
+      // any other order, e.g. PlanExecutor::getSchedule()
+    BufferPlan(const ContractionOptimizer& cOp,
+	       const std::vector<std::vector<compStep_t>>& schedule);
+
+      // sizes in complex numbers: the arena, and one buffer per tensor
+    unsigned long getArenaSize() const { return arenaSize; }
+    unsigned long getUnsharedSize() const { return unsharedSize; }
+    size_t getNumSlots() const;
+    const std::map<uint, buffer_t>& getBufferMap() const { return bufferMap; }
+    unsigned long getOffset(uint tensId) const { return bufferMap.at(tensId).offset; }
+
+      // points tens[id] into arena for every tensor of the plan, arena
+      // holding getArenaSize() complex numbers
+    void bind(double* arena, double** tens) const;
+
+      // one line per tensor, with a header line
+    void writeCSV(std::ostream& out) const;
+
+  private:
+    void _assign(const ContractionOptimizer& cOp,
+		 const std::vector<std::vector<compStep_t>>& schedule);
+};
+
+
+
+
+// ***************************************************************
+#endif
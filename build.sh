@@ -1,6 +1,15 @@
 #!/usr/bin/env bash
   
 g++ -c -g -DNDEBUG -O3 -Wall -std=c++17 diagram.cc -o diagram.o
-g++ -c -g -DNDEBUG -O3 -Wall -std=c++17 contraction_optimizer.cc -o contraction_optimizer.o
+g++ -c -g -DNDEBUG -O3 -Wall -std=c++17 -pthread contraction_optimizer.cc -o contraction_optimizer.o
 g++ -c -g -DNDEBUG -O3 -Wall -std=c++17 graph.cc -o graph.o
-g++ -g -DNDEBUG -O3 -Wall -std=c++17 driver.cc contraction_optimizer.o diagram.o graph.o
+g++ -c -g -DNDEBUG -O3 -Wall -std=c++17 diagram_store.cc -o diagram_store.o
+g++ -c -g -DNDEBUG -O3 -Wall -std=c++17 -pthread diagram_builder.cc -o diagram_builder.o
+g++ -c -g -DNDEBUG -O3 -Wall -std=c++17 code_generator.cc -o code_generator.o
+g++ -c -g -DNDEBUG -O3 -Wall -std=c++17 plan_executor.cc -o plan_executor.o
+g++ -c -g -DNDEBUG -O3 -Wall -std=c++17 cost_report.cc -o cost_report.o
+g++ -c -g -DNDEBUG -O3 -Wall -std=c++17 buffer_plan.cc -o buffer_plan.o
+g++ -c -g -DNDEBUG -O3 -Wall -std=c++17 -pthread streaming_executor.cc -o streaming_executor.o
+g++ -c -g -DNDEBUG -O3 -Wall -std=c++17 -pthread optimizer_service.cc -o optimizer_service.o
+g++ -g -DNDEBUG -O3 -Wall -std=c++17 driver.cc buffer_plan.o code_generator.o contraction_optimizer.o cost_report.o diagram.o diagram_builder.o diagram_store.o graph.o optimizer_service.o plan_executor.o streaming_executor.o -pthread
+g++ -g -DNDEBUG -O3 -Wall -std=c++17 optimizer_daemon.cc contraction_optimizer.o diagram.o diagram_store.o graph.o optimizer_service.o -pthread -o contraction_service
@@ -0,0 +1,243 @@
+#include "code_generator.h"
+
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+using namespace std;
+
+
+  /*
+   *
+   * 	CodeGenerator implementation
+   *
+   */
+
+
+  CodeGenerator::CodeGenerator(const ContractionOptimizer& _cOp) :
+    	cOp(_cOp), nDil(ContractionCost::getDilutionRange()) {
+
+    if (nDil == 0)
+      throw(std::string("Must set dilution range first."));
+
+    for (const auto& aStep : cOp.getCompStepList()) {
+      uint stepKind = ContractionOptimizer::getStepKind(std::get<0>(aStep));
+      if (stepKind == stepPermute)
+	viewMap[std::get<2>(aStep)] = std::make_pair(std::get<1>(aStep).first, std::get<0>(aStep));
+      else if (stepKind == stepAccumulate)
+	accumulateSet.insert(std::get<2>(aStep));
+      else
+	kernelMap.emplace(_getShape(aStep), kernelMap.size());
+    }
+  }
+
+  unsigned long CodeGenerator::_getTensorSize(uint tensId) const {
+    unsigned long ret = 1;
+    for (uint iI = 0; iI < cOp.getTensorRank(tensId); ++iI) ret *= nDil;
+    return ret;
+  }
+
+  uint CodeGenerator::_resolveView(uint tensId) const {
+    auto vIt = viewMap.find(tensId);
+    return (vIt == viewMap.end()) ? tensId : vIt->second.first;
+  }
+
+  CodeGenerator::stepShape_t CodeGenerator::_getShape(const compStep_t& aStep) const {
+    const iTup& globTensPair = std::get<1>(aStep);
+    auto vIt1 = viewMap.find(globTensPair.first), vIt2 = viewMap.find(globTensPair.second);
+    return stepShape_t(std::get<0>(aStep),
+		       cOp.getTensorRank(globTensPair.first),
+		       cOp.getTensorRank(globTensPair.second),
+		       (vIt1 == viewMap.end()) ? 0 : vIt1->second.second,
+		       (vIt2 == viewMap.end()) ? 0 : vIt2->second.second);
+  }
+
+
+    // row-major strides of a tensor of rank nInds, or of a permuted view on
+    // such a tensor if permCode is a stepPermute code
+  static vector<unsigned long> _getStrides(uint nInds, uint nDil, uint permCode = 0) {
+    vector<unsigned long> strides(nInds, 1);
+    for (int iI = int(nInds) - 2; iI >= 0; --iI)
+      strides[iI] = strides[iI+1]*nDil;
+
+    if (permCode == 0) return strides;
+
+    vector<unsigned long> viewStrides;
+    for (auto aInd : ContractionOptimizer::decodePermutation(permCode, nInds))
+      viewStrides.push_back(strides[aInd]);
+    return viewStrides;
+  }
+
+    // offset expression sum_i name_i*stride_i, with constant strides
+  static string _offsetExpr(const vector<string>& indNames,
+			    const vector<unsigned long>& strides) {
+    if (indNames.empty()) return "0";
+
+    string ret;
+    for (uint iI = 0; iI < indNames.size(); ++iI) {
+      if (iI > 0) ret += " + ";
+      ret += indNames[iI];
+      if (strides[iI] != 1) ret += "*" + to_string(strides[iI]) + "ul";
+    }
+    return ret;
+  }
+
+
+  void CodeGenerator::_generateKernel(std::ostream& out, const stepShape_t& shape,
+				      uint kernelId) const {
+    uint stepCode, nInds1, nInds2, permCode1, permCode2;
+    std::tie(stepCode, nInds1, nInds2, permCode1, permCode2) = shape;
+    auto contrSet = Graph::decodeElement(stepCode);
+
+      // name the loop variables: free indices of tensor 1 are a*, free
+      // indices of tensor 2 are b*, contracted pairs share c*
+    vector<string> indNames1(nInds1), indNames2(nInds2);
+    vector<string> freeNames1, freeNames2, contrNames;
+    for (auto cIt : contrSet) {
+      string cName = "c" + to_string(contrNames.size());
+      indNames1[cIt.first] = indNames2[cIt.second] = cName;
+      contrNames.push_back(cName);
+    }
+    for (uint iI = 0; iI < nInds1; ++iI)
+      if (indNames1[iI].empty()) {
+	indNames1[iI] = "a" + to_string(iI);
+	freeNames1.push_back(indNames1[iI]);
+      }
+    for (uint iI = 0; iI < nInds2; ++iI)
+      if (indNames2[iI].empty()) {
+	indNames2[iI] = "b" + to_string(iI);
+	freeNames2.push_back(indNames2[iI]);
+      }
+
+    vector<string> resNames(freeNames1);
+    resNames.insert(resNames.end(), freeNames2.begin(), freeNames2.end());
+
+    unsigned long resSize = 1;
+    for (uint iI = 0; iI < resNames.size(); ++iI) resSize *= nDil;
+
+    string off1 = _offsetExpr(indNames1, _getStrides(nInds1, nDil, permCode1)),
+	   off2 = _offsetExpr(indNames2, _getStrides(nInds2, nDil, permCode2)),
+	   offRes = _offsetExpr(resNames, _getStrides(resNames.size(), nDil));
+
+    out << "  // step code 0x" << hex << stepCode << dec
+	<< ", operand ranks " << nInds1 << " x " << nInds2
+	<< " -> rank " << resNames.size() << ", cost Ndil^"
+	<< nInds1 + nInds2 - contrSet.size();
+    if (permCode1 != 0) out << ", operand 1 permuted 0x" << hex << permCode1 << dec;
+    if (permCode2 != 0) out << ", operand 2 permuted 0x" << hex << permCode2 << dec;
+    out << "\n";
+    out << "static void contract_" << kernelId
+	<< "(const double* __restrict__ t1, const double* __restrict__ t2, double* __restrict__ res) {\n";
+    out << "  for (unsigned long iR = 0; iR < " << 2*resSize << "ul; ++iR) res[iR] = 0.;\n";
+
+      // free indices of tensor 1 outermost, contracted indices next, and
+      // free indices of tensor 2 innermost, so that the innermost loop runs
+      // over contiguous memory in res and, typically, in t2
+    string indent = "  ";
+    vector<string> loopNames(freeNames1);
+    loopNames.insert(loopNames.end(), contrNames.begin(), contrNames.end());
+    loopNames.insert(loopNames.end(), freeNames2.begin(), freeNames2.end());
+    for (const auto& lName : loopNames) {
+      out << indent << "for (unsigned long " << lName << " = 0; " << lName
+	  << " < " << nDil << "ul; ++" << lName << ") {\n";
+      indent += "  ";
+    }
+
+    out << indent << "const unsigned long o1 = 2*(" << off1 << "), o2 = 2*(" << off2
+	<< "), oR = 2*(" << offRes << ");\n";
+    out << indent << "res[oR]   += t1[o1]*t2[o2]   - t1[o1+1]*t2[o2+1];\n";
+    out << indent << "res[oR+1] += t1[o1]*t2[o2+1] + t1[o1+1]*t2[o2];\n";
+
+    for (uint iL = 0; iL < loopNames.size(); ++iL) {
+      indent.resize(indent.size() - 2);
+      out << indent << "}\n";
+    }
+    out << "}\n\n";
+  }
+
+
+  void CodeGenerator::generate(std::ostream& out, const std::string& funcName,
+			       const BufferPlan* bufferPlan) const {
+    out << "// generated by CodeGenerator for Ndil = " << nDil << "\n";
+    out << "// " << cOp.getCompStepList().size() << " contraction steps, "
+	<< kernelMap.size() << " distinct kernels\n\n";
+
+      // ranks of all tensors occurring in the plan, so that the caller can
+      // size the storage passed to the driver
+    out << "// { tensor ID, rank }\n";
+    out << "const unsigned int " << funcName << "_tensors[][2] = {\n";
+    for (auto tIt : cOp.getTensorRankMap())
+      if (tIt.second == 0 || viewMap.find(tIt.first) == viewMap.end())
+	out << "  { " << tIt.first << ", " << tIt.second << " },\n";
+    out << "};\n\n";
+
+      // permuted views of rank > 0 need no storage, scalar views are copied
+    if (!viewMap.empty()) {
+      out << "// { view ID, ID of the underlying tensor }\n";
+      out << "const unsigned int " << funcName << "_views[][2] = {\n";
+      for (auto vIt : viewMap)
+	out << "  { " << vIt.first << ", " << vIt.second.first << " },\n";
+      out << "};\n\n";
+    }
+
+    if (bufferPlan) {
+      out << "// storage of the tensors formed by the plan within one arena of\n";
+      out << "// " << funcName << "_arena_size complex numbers: { tensor ID, offset }\n";
+      out << "const unsigned long " << funcName << "_arena_size = "
+	  << bufferPlan->getArenaSize() << "ul;\n";
+      out << "const unsigned long " << funcName << "_offsets[][2] = {\n";
+      for (const auto& bIt : bufferPlan->getBufferMap())
+	out << "  { " << bIt.first << ", " << bIt.second.offset << " },\n";
+      out << "};\n\n";
+    }
+
+    for (auto kIt : kernelMap)
+      _generateKernel(out, kIt.first, kIt.second);
+
+    if (!accumulateSet.empty()) {
+      out << "// res += coeff*t for n complex numbers\n";
+      out << "static void accumulate(const double* __restrict__ t, double coeff, unsigned long n, "
+	  << "double* __restrict__ res) {\n";
+      out << "  for (unsigned long iR = 0; iR < 2*n; ++iR) res[iR] += coeff*t[iR];\n";
+      out << "}\n\n";
+    }
+
+    out << "// tens[id] must point to the storage of tensor id for all tensors\n";
+    out << "// listed in " << funcName << "_tensors\n";
+    out << "void " << funcName << "(double* const* tens) {\n";
+
+      // accumulation targets start from zero, cleared only when first
+      // written so that they can share storage with earlier tensors
+    set<uint> zeroedSet;
+    for (const auto& aStep : cOp.getCompStepList()) {
+      const iTup& globTensPair = std::get<1>(aStep);
+      uint newId = std::get<2>(aStep);
+
+      if (ContractionOptimizer::getStepKind(std::get<0>(aStep)) == stepAccumulate) {
+	if (zeroedSet.insert(newId).second)
+	  out << "  for (unsigned long iR = 0; iR < " << 2*_getTensorSize(newId)
+	      << "ul; ++iR) tens[" << newId << "][iR] = 0.;\n";
+	  // print the coefficient exactly
+	std::ostringstream coeff;
+	coeff.precision(17);
+	coeff << cOp.getCoefficient(std::get<0>(aStep));
+	out << "  accumulate(tens[" << _resolveView(globTensPair.first) << "], " << coeff.str()
+	    << ", " << _getTensorSize(newId) << "ul, tens[" << newId << "]);\n";
+	continue;
+      }
+
+      if (ContractionOptimizer::getStepKind(std::get<0>(aStep)) == stepPermute) {
+	if (cOp.getTensorRank(newId) == 0)
+	  out << "  tens[" << newId << "][0] = tens[" << globTensPair.first << "][0]; "
+	      << "tens[" << newId << "][1] = tens[" << globTensPair.first << "][1];\n";
+	continue;
+      }
+
+      out << "  contract_" << kernelMap.at(_getShape(aStep))
+	  << "(tens[" << _resolveView(globTensPair.first) << "], tens["
+	  << _resolveView(globTensPair.second) << "], tens[" << newId << "]);\n";
+    }
+    out << "}\n";
+  }
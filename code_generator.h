@@ -0,0 +1,66 @@
+#ifndef CODE_GENERATOR_H
+#define CODE_GENERATOR_H
+
+#include <ostream>
+#include <set>
+#include <string>
+
+#include "contraction_optimizer.h"
+#include "buffer_plan.h"
+
+
+
+  // Emits C++ source evaluating a tuned plan for a fixed dilution range.
+  // Every distinct step shape -- index pairs and operand ranks -- becomes
+  // one kernel with compile-time loop bounds and strides; a driver function
+  // calls the kernels in the order of the plan.
+  //
+  // Tensors are row-major arrays of interleaved double precision complex
+  // numbers (re, im), the last index running fastest. The index order of
+  // an intermediary is that of Graph::doReplacement: the uncontracted
+  // indices of the first tensor, followed by those of the second tensor.
+  // Permuted views (stepPermute) are not materialized, kernels reading them
+  // access the underlying tensor with permuted strides instead.
+  // Accumulation targets (stepAccumulate) are zeroed by the driver function
+  // before they are first written.
+class CodeGenerator {
+
+  private:
+      // (step code, rank of first tensor, rank of second tensor,
+      //  permutation step codes of the operands, 0 if not a view)
+    typedef std::tuple<uint, uint, uint, uint, uint> stepShape_t;
+
+    const ContractionOptimizer& cOp;
+    unsigned int nDil;
+    std::map<stepShape_t, uint> kernelMap;
+      // view ID -> (ID of the underlying tensor, permutation step code)
+    std::map<uint, std::pair<uint, uint>> viewMap;
+      // targets of stepAccumulate steps
+    std::set<uint> accumulateSet;
+
+  public:
+    CodeGenerator(const ContractionOptimizer& _cOp);
+
+      // number of distinct kernels required for the plan
+    size_t getNumKernels() const { return kernelMap.size(); }
+
+      // writes kernels and the driver function
+      // 	void funcName(double* const* tens)
+      // where tens[id] points to the storage of tensor id. Given a
+      // BufferPlan(cOp), the offsets of all tensors formed by the plan
+      // within one shared arena are written as well
+    void generate(std::ostream& out, const std::string& funcName = "evaluatePlan",
+		  const BufferPlan* bufferPlan = nullptr) const;
+
+  private:
+    void _generateKernel(std::ostream& out, const stepShape_t& shape, uint kernelId) const;
+    stepShape_t _getShape(const compStep_t& aStep) const;
+    uint _resolveView(uint tensId) const;
+    unsigned long _getTensorSize(uint tensId) const;
+};
+
+
+
+
+// ***************************************************************
+#endif  
@@ -3,13 +3,33 @@
 #include <tuple>
 #include <algorithm>
 #include <iostream>
+#include <chrono>
+#include <fstream>
+#include <cstdio>
+#include <numeric>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <exception>
 //#include <functional>
 
 
 using namespace std;
 
   ContractionOptimizer::ContractionOptimizer(const std::vector<Diagram>& _diagList) :
-    	diagList(_diagList), CSECost(), noCSECost() {};
+    	diagList(_diagList), CSECost(), noCSECost(), accumulateCost(), useDiagramStore(false),
+	maxRank(0), memoryBudget(0), bytesPerElement(16), usePermutationCSE(false),
+	useFactorisation(false), timeBudget(0.), maxCandidates(0), sampleFraction(1.),
+	checkpointInterval(600.), nDiagDone(0), maxTensId(0), verbose(true),
+	randomTieBreak(false) {};
+
+  ContractionOptimizer::ContractionOptimizer(std::vector<Diagram>&& _diagList) :
+    	diagList(std::move(_diagList)), CSECost(), noCSECost(), accumulateCost(), useDiagramStore(false),
+	maxRank(0), memoryBudget(0), bytesPerElement(16), usePermutationCSE(false),
+	useFactorisation(false), timeBudget(0.), maxCandidates(0), sampleFraction(1.),
+	checkpointInterval(600.), nDiagDone(0), maxTensId(0), verbose(true),
+	randomTieBreak(false) {};
 
 
   void _printContractionList(const map<iTup, set<iTup>>& cList) {
@@ -28,69 +48,1108 @@ using namespace std;
     if (ContractionCost::getDilutionRange()==0)
       throw(std::string("Must set dilution range first."));
 
-      // determine cost without CSE and 
-      // smallest global tensor ID we can use for intermediaries
-    unsigned int maxTensId = 0;
+    tuneReport = TuneReport();
+    if (useFactorisation) _factoriseDiagrams();
+    _runTune(false);
+    _accumulateCorrelators();
+  }
+
+  void ContractionOptimizer::resume(const std::string& fileName) {
+    _readCheckpoint(fileName);
+    _runTune(true);
+    _accumulateCorrelators();
+  }
+
+  void ContractionOptimizer::tuneRandomised(uint nRestarts, uint nThreads, uint64_t seed) {
+    if (ContractionCost::getDilutionRange()==0)
+      throw(std::string("Must set dilution range first."));
+    if (nRestarts == 0)
+      throw(std::string("Need at least one restart."));
+
+    auto tuneStart = std::chrono::steady_clock::now();
+    if (nThreads == 0) nThreads = max(1u, std::thread::hardware_concurrency());
+    nThreads = min(nThreads, nRestarts);
+
+      // every restart starts from a copy of the untuned state
+    const ContractionOptimizer initial(*this);
+    size_t nDiag = diagList.size();
+
+    std::atomic<uint> nextRestart(0);
+    std::mutex bestMutex;
+    std::unique_ptr<ContractionOptimizer> best;
+    uint bestRestart = 0;
+    std::exception_ptr error;
+
+    auto runRestarts = [&] () {
+      try {
+	for (uint iR = nextRestart++; iR < nRestarts; iR = nextRestart++) {
+	  auto candidate = std::make_unique<ContractionOptimizer>(initial);
+	  candidate->verbose = false;
+	  candidate->checkpointFile.clear();
+
+	  std::vector<size_t> order(nDiag);
+	  std::iota(order.begin(), order.end(), 0);
+	  if (iR > 0) {
+	    std::mt19937_64 rng(seed + iR);
+	    std::shuffle(order.begin(), order.end(), rng);
+	    candidate->randomTieBreak = true;
+	    candidate->tieBreakRng.seed(rng());
+
+	    std::vector<Diagram> shuffled;
+	    shuffled.reserve(nDiag);
+	    for (auto iD : order)
+	      shuffled.push_back(std::move(candidate->diagList[iD]));
+	    candidate->diagList = std::move(shuffled);
+	  }
+
+	  candidate->tune();
+
+	    // back to the original order of the diagrams
+	  if (iR > 0) {
+	    std::vector<size_t> position(nDiag);
+	    for (size_t iD = 0; iD < nDiag; ++iD) position[order[iD]] = iD;
+	    std::vector<Diagram> tuned;
+	    tuned.reserve(nDiag);
+	    for (auto iD : position)
+	      tuned.push_back(std::move(candidate->diagList[iD]));
+	    candidate->diagList = std::move(tuned);
+	  }
+
+	    // ties go to the lowest restart, so the result does not depend on
+	    // the order in which the threads finish
+	  std::lock_guard<std::mutex> lock(bestMutex);
+	  if (!best || candidate->CSECost < best->CSECost
+	      || (!(best->CSECost < candidate->CSECost) && iR < bestRestart)) {
+	    best = std::move(candidate);
+	    bestRestart = iR;
+	  }
+	}
+      }
+      catch (...) {
+	std::lock_guard<std::mutex> lock(bestMutex);
+	if (!error) error = std::current_exception();
+	nextRestart = nRestarts;
+      }
+    };
+
+    std::vector<std::thread> threadList;
+    for (uint iT = 1; iT < nThreads; ++iT)
+      threadList.emplace_back(runRestarts);
+    runRestarts();
+    for (auto& aThread : threadList)
+      aThread.join();
+
+    if (error)
+      std::rethrow_exception(error);
+
+      // adopt the best plan, but keep the settings of this optimizer that
+      // were switched off for the restarts
+    bool keepVerbose = verbose;
+    std::string keepCheckpointFile = checkpointFile;
+    *this = std::move(*best);
+    verbose = keepVerbose;
+    checkpointFile = keepCheckpointFile;
+
+    tuneReport.tuneTime = std::chrono::duration<double>(
+	      std::chrono::steady_clock::now() - tuneStart).count();
+    tuneReport.nRestarts = nRestarts;
+    tuneReport.bestRestart = bestRestart;
+  }
+
+  void ContractionOptimizer::_runTune(bool isResumed) {
+    if (useDiagramStore) {
+      DiagramStore diagStore(diagList);
+	// the store holds the only copy of the diagrams while tuning
+      std::vector<Diagram>().swap(diagList);
+      _tune(diagStore, isResumed);
+      diagList = diagStore.getDiagramList();
+    }
+    else
+      _tune(diagList, isResumed);
+  }
 
-    for (auto dIt : diagList) {
-      noCSECost += dIt.getGraph().getRemainingCost();
+
+  void ContractionOptimizer::replicate(const std::vector<std::map<uint, uint>>& idMapList) {
+    for (const auto& aDiag : diagList)
+      if (!aDiag.isDone())
+	throw(std::string("Must tune template diagrams before replicating them."));
+
+      // intermediaries of the template plan get new IDs in every replica,
+      // beyond any ID occurring in the templates or the ID maps
+    std::set<uint> interSet;
+    uint maxReplicaId = 0;
+    for (auto tIt : tensRankMap)
+      maxReplicaId = max(maxReplicaId, tIt.first);
+    for (const auto& aStep : compStepList)
+      interSet.insert(std::get<2>(aStep));
+    for (const auto& idMap : idMapList)
+      for (auto mIt : idMap)
+	maxReplicaId = max(maxReplicaId, mIt.second);
+
+    std::list<compStep_t> newStepList;
+    std::vector<Diagram> newDiagList;
+    std::map<uint, uint> newRankMap;
+    ContractionCost newCSECost, newNoCSECost, newAccumulateCost;
+      // (step code, operand IDs) -> result ID of all steps emitted so far,
+      // to find the steps shared between replicas
+    std::map<std::tuple<uint, uint, uint>, uint> stepIdMap;
+
+    newDiagList.reserve(diagList.size()*idMapList.size());
+    for (const auto& idMap : idMapList) {
+      std::map<uint, uint> interMap;
+      auto getReplicaId = [&](uint tId) {
+	if (interSet.count(tId)) return interMap.at(tId);
+	auto mIt = idMap.find(tId);
+	return (mIt == idMap.end()) ? tId : mIt->second;
+      };
+
+      for (const auto& aStep : compStepList) {
+	uint stepCode = std::get<0>(aStep);
+	iTup globTensPair(getReplicaId(std::get<1>(aStep).first),
+			  getReplicaId(std::get<1>(aStep).second));
+
+	  // accumulation targets are never shared between replicas, and get
+	  // their ID with the first step accumulating into them
+	if (getStepKind(stepCode) == stepAccumulate) {
+	  uint nInds = tensRankMap.at(std::get<2>(aStep));
+	  auto iIt = interMap.find(std::get<2>(aStep));
+	  if (iIt == interMap.end()) {
+	    iIt = interMap.emplace(std::get<2>(aStep), ++maxReplicaId).first;
+	    newRankMap[iIt->second] = nInds;
+	  }
+	  newRankMap[globTensPair.first] = nInds;
+	  if (nInds > 0) newAccumulateCost += nInds;
+	  newStepList.push_back(std::make_tuple(stepCode, globTensPair, iIt->second));
+	  continue;
+	}
+
+	auto sKey = std::make_tuple(stepCode, globTensPair.first, globTensPair.second);
+	auto sIt = stepIdMap.find(sKey);
+	if (sIt != stepIdMap.end()) {
+	  interMap[std::get<2>(aStep)] = sIt->second;
+	  continue;
+	}
+
+	uint newId = ++maxReplicaId;
+	uint nInds1 = tensRankMap.at(std::get<1>(aStep).first),
+	     nInds2 = tensRankMap.at(std::get<1>(aStep).second);
+	newRankMap[globTensPair.first] = nInds1;
+	newRankMap[globTensPair.second] = nInds2;
+	if (getStepKind(stepCode) == stepPermute)
+	  newRankMap[newId] = nInds1;
+	else {
+	  uint nContr = Graph::getNumContractions(stepCode);
+	  newRankMap[newId] = nInds1 + nInds2 - 2*nContr;
+	  newCSECost += nInds1 + nInds2 - nContr;
+	  newCSECost.updateMaxIntermediateRank(nInds1 + nInds2 - 2*nContr);
+	}
+
+	stepIdMap.emplace(sKey, newId);
+	interMap[std::get<2>(aStep)] = newId;
+	newStepList.push_back(std::make_tuple(stepCode, globTensPair, newId));
+      }
+
+      for (const auto& aDiag : diagList) {
+	std::vector<uint> resultIdList;
+	for (auto rId : aDiag.getResultIdList())
+	  resultIdList.push_back(getReplicaId(rId));
+	newDiagList.push_back(Diagram(aDiag.getGraph(), std::vector<uint>(), std::move(resultIdList)));
+	newDiagList.back().setCorrelator(aDiag.getCorrelatorId(), aDiag.getWeight());
+      }
+
+      newNoCSECost += noCSECost;
+    }
+
+    compStepList = std::move(newStepList);
+    diagList = std::move(newDiagList);
+    tensRankMap = std::move(newRankMap);
+    CSECost = newCSECost;
+    noCSECost = newNoCSECost;
+    accumulateCost = newAccumulateCost;
+  }
+
+
+  uint ContractionOptimizer::encodePermutation(const std::vector<uint>& perm) {
+    uint stepCode = stepPermute;
+    for (uint iI = 0; iI < perm.size(); ++iI)
+      stepCode |= (perm[iI] & 0x7u) << (8 + 3*iI);
+    return stepCode;
+  }
+
+  std::vector<uint> ContractionOptimizer::decodePermutation(uint stepCode, uint nInds) {
+    std::vector<uint> perm(nInds);
+    for (uint iI = 0; iI < nInds; ++iI)
+      perm[iI] = (stepCode >> (8 + 3*iI)) & 0x7u;
+    return perm;
+  }
+
+
+    // signatures of input tensors are created on first use
+  const ContractionOptimizer::tensSignature_t& ContractionOptimizer::_getSignature(uint tensId) {
+    auto sIt = signatureMap.find(tensId);
+    if (sIt != signatureMap.end()) return sIt->second;
+
+    tensSignature_t& aSig = signatureMap[tensId];
+    aSig.leafList.push_back(tensId);
+    for (uint iI = 0; iI < tensRankMap.at(tensId); ++iI)
+      aSig.freeList.push_back((uint64_t(tensId) << 3) | iI);
+    return aSig;
+  }
+
+  bool ContractionOptimizer::_matchPermutedIntermediary(const compStep_t& aStep) {
+    uint stepCode, newId;
+    iTup globTensPair;
+    std::tie(stepCode, globTensPair, newId) = aStep;
+
+    const tensSignature_t& sig1 = _getSignature(globTensPair.first);
+    const tensSignature_t& sig2 = _getSignature(globTensPair.second);
+    tensSignature_t newSig;
+
+    std::merge(sig1.leafList.begin(), sig1.leafList.end(),
+	       sig2.leafList.begin(), sig2.leafList.end(),
+	       std::back_inserter(newSig.leafList));
+    std::merge(sig1.edgeList.begin(), sig1.edgeList.end(),
+	       sig2.edgeList.begin(), sig2.edgeList.end(),
+	       std::back_inserter(newSig.edgeList));
+
+    auto contrSet = Graph::decodeElement(stepCode);
+    std::vector<bool> isFree1(sig1.freeList.size(), true), isFree2(sig2.freeList.size(), true);
+    for (auto cIt : contrSet) {
+      uint64_t ind1 = sig1.freeList[cIt.first], ind2 = sig2.freeList[cIt.second];
+      newSig.edgeList.push_back(std::make_pair(min(ind1, ind2), max(ind1, ind2)));
+      isFree1[cIt.first] = isFree2[cIt.second] = false;
+    }
+    std::sort(newSig.edgeList.begin(), newSig.edgeList.end());
+    for (uint iI = 0; iI < isFree1.size(); ++iI)
+      if (isFree1[iI]) newSig.freeList.push_back(sig1.freeList[iI]);
+    for (uint iI = 0; iI < isFree2.size(); ++iI)
+      if (isFree2[iI]) newSig.freeList.push_back(sig2.freeList[iI]);
+
+      // an input tensor occurring twice makes indices ambiguous, don't try
+      // to match such intermediaries
+    bool isUnique = (std::adjacent_find(newSig.leafList.begin(), newSig.leafList.end())
+		     == newSig.leafList.end());
+
+    std::vector<uint64_t> sigKey(newSig.leafList);
+    sigKey.push_back(~uint64_t(0));
+    for (auto eIt : newSig.edgeList) {
+      sigKey.push_back(eIt.first);
+      sigKey.push_back(eIt.second);
+    }
+
+    auto kIt = isUnique ? signatureIdMap.find(sigKey) : signatureIdMap.end();
+    if (kIt == signatureIdMap.end()) {
+      if (isUnique) signatureIdMap.emplace(std::move(sigKey), newId);
+      signatureMap[newId] = std::move(newSig);
+      return false;
+    }
+
+      // the same content has been formed before, only the index order
+      // differs: index k of the view is index perm[k] of the existing tensor
+    uint baseId = kIt->second;
+    const auto& baseFreeList = signatureMap.at(baseId).freeList;
+    std::vector<uint> perm;
+    for (auto aInd : newSig.freeList)
+      perm.push_back(std::find(baseFreeList.begin(), baseFreeList.end(), aInd) - baseFreeList.begin());
+
+    compStepList.push_back(std::make_tuple(encodePermutation(perm), iTup(baseId, baseId), newId));
+    signatureMap[newId] = std::move(newSig);
+    return true;
+  }
+
+
+    // the effective rank limit from maxRank and memoryBudget
+  uint ContractionOptimizer::_getRankLimit() const {
+    if (memoryBudget == 0) return maxRank;
+
+    size_t nDil = ContractionCost::getDilutionRange();
+      // with a dilution range of 1, or elements of no size, the size of a
+      // tensor does not depend on its rank
+    if (nDil <= 1 || bytesPerElement == 0) return maxRank;
+
+    uint budgetRank = 0;
+      // a tensor of rank budgetRank+1 fits if tensSize*nDil does, the
+      // division keeps that product from overflowing
+    for (size_t tensSize = bytesPerElement; tensSize <= memoryBudget / nDil; tensSize *= nDil)
+      budgetRank++;
+      // a budget below a single vector still gets the smallest possible
+      // intermediaries rather than no limit at all
+    budgetRank = max(budgetRank, 1u);
+
+    return (maxRank == 0) ? budgetRank : min(maxRank, budgetRank);
+  }
+
+
+  template <class DiagContainer>
+  void ContractionOptimizer::_tune(DiagContainer& diags, bool isResumed) {
+    if (!isResumed) {
+      nDiagDone = 0;
+      maxTensId = 0;
+    }
+      // a resumed run continues the clock of the interrupted one
+    auto tuneStart = std::chrono::steady_clock::now()
+      - std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+	  std::chrono::duration<double>(tuneReport.tuneTime));
+    auto lastCheckpoint = std::chrono::steady_clock::now();
+
+    uint rankLimit = _getRankLimit();
+    size_t sampleStride = (sampleFraction < 1.) ?
+			  size_t(1./max(sampleFraction, 1e-6) + 0.5) : 1;
+
+      // determine cost without CSE,
+      // smallest global tensor ID we can use for intermediaries, and
+      // the ranks of all input tensors
+    size_t nDiag = diags.size();
+
+    for (size_t iD = 0; iD < nDiag && !isResumed; ++iD) {
+      auto&& aDiag = diags[iD];
+      noCSECost += aDiag.getGraph().getRemainingCost(rankLimit);
+      const auto& tensIdList = aDiag.getRemainingTensors();
       maxTensId = max(maxTensId, *std::max_element(
-	    		dIt.getRemainingTensors().begin(),
-	    		dIt.getRemainingTensors().end()));
+	    		tensIdList.begin(), tensIdList.end()));
+
+      auto tensSizeList = aDiag.getGraph().getAllNumInds();
+      uint iT = 0;
+      for (auto tId : tensIdList)
+	tensRankMap[tId] = tensSizeList[iT++];
     }
 
-    unsigned int iDiag = 1, nDiag = diagList.size();
-    for (auto dIt = diagList.begin(); dIt != diagList.end(); ++dIt) {
-      cout<<"Diagram "<<iDiag<<"/"<<nDiag<<"\n";
-      ++iDiag;
+      // once the time budget is used up, only local steps are taken. From
+      // then on no more global steps are added, so the contractions in the
+      // plan can be looked up with the local ones
+    auto isOverBudget = [&] () {
+      if (tuneReport.budgetExhausted || timeBudget <= 0.)
+	return tuneReport.budgetExhausted;
+      if (std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - tuneStart).count() <= timeBudget)
+	return false;
 
-      while (!dIt->isDone()) {
+      tuneReport.budgetExhausted = true;
+      for (const auto& aStep : compStepList)
+	if (getStepKind(std::get<0>(aStep)) == stepContract)
+	  localStepMap.emplace(make_tuple(std::get<0>(aStep), std::get<1>(aStep).first,
+					  std::get<1>(aStep).second), std::get<2>(aStep));
+      return true;
+    };
 
-	  // obtain list of good next steps
-	unsigned int stepCost;
-	vector<pair<uint, iTup>> stepList;
-	tie(stepCost, stepList) = dIt->singleTermOpt();
+      // locally optimal steps, the buffer is reused for every step
+    vector<pair<uint, iTup>> stepList;
+    for (size_t iDiag = nDiagDone; iDiag < nDiag; ++iDiag) {
+      if (verbose) cout<<"Diagram "<<iDiag+1<<"/"<<nDiag<<"\n";
 
-	CSECost += stepCost;
+      if (isOverBudget()) {
+	_tuneLocal(diags[iDiag], rankLimit);
+	tuneReport.nDiagLocal++;
+      }
+      else
+	tuneReport.nDiagGlobal++;
+
+      while (!diags[iDiag].isDone()) {
+	  // the budget is checked at every step, so that one large diagram
+	  // cannot overrun it; the rest of the diagram is then done locally
+	if (isOverBudget()) {
+	  _tuneLocal(diags[iDiag], rankLimit);
+	  break;
+	}
+
+	  // obtain list of good next steps
+	unsigned int stepCost = diags[iDiag].singleTermOpt(stepList, rankLimit);
+	if (randomTieBreak)
+	  std::shuffle(stepList.begin(), stepList.end(), tieBreakRng);
+	if (maxCandidates > 0 && stepList.size() > maxCandidates)
+	  stepList.resize(maxCandidates);
 
 	  // reserve ID for new intermediary
 	maxTensId++;
 
-	compStep_t globOptStep;
-	ContractionCost globOptProfit;
-	vector<Diagram*> replList;
-
-	  // even if there's only one suggested next step, go through all
-	  // diagrams here, and keep track of the diagrams that will need
-	  // a replacement in the next step
-	for (auto sIt : stepList) {
-	  ContractionCost globProfit;
-	  vector<Diagram*> tmpReplList;
-
-	  for (auto ddIt = dIt; ddIt != diagList.end(); ++ddIt) {
-	    if (ddIt->isDone()) continue;
-	      // if the step is a subexpression, track the diagram
-	    if(ddIt->getProfit(sIt.first, sIt.second, globProfit))
-	      tmpReplList.push_back(&(*ddIt));
-	  }
+	compStep_t globOptStep = make_tuple(stepList.front().first,
+					    stepList.front().second, maxTensId);
+
+	  // break ties between the suggested steps by their profit across
+	  // (a sample of) all remaining diagrams
+	if (stepList.size() > 1) {
+	  ContractionCost globOptProfit;
+
+	  for (auto sIt : stepList) {
+	    ContractionCost globProfit;
 
-	  if (globOptProfit < globProfit) {
-	    globOptProfit = globProfit;
-	    globOptStep = make_tuple(sIt.first, sIt.second, maxTensId);
-	    replList = tmpReplList;
+	    for (size_t jDiag = iDiag; jDiag < nDiag; jDiag += sampleStride) {
+	      auto&& ddIt = diags[jDiag];
+	      if (ddIt.isDone()) continue;
+	      ddIt.getProfit(sIt.first, sIt.second, globProfit, rankLimit);
+	    }
+
+	    if (globOptProfit < globProfit) {
+	      globOptProfit = globProfit;
+	      globOptStep = make_tuple(sIt.first, sIt.second, maxTensId);
+	    }
 	  }
 	}
 
 	  // store compStep
-	compStepList.push_back(globOptStep);
+	_addStep(globOptStep, stepCost);
 
 	  // replace the subexpression everywhere
-	for (auto ddIt = replList.begin(); ddIt != replList.end(); ++ddIt) {
-	  if ((*ddIt)->isDone()) continue;
-	  (*ddIt)->replaceSubexpression(std::get<0>(globOptStep),
-				     std::get<1>(globOptStep),
-				     std::get<2>(globOptStep));
+	for (size_t jDiag = iDiag; jDiag < nDiag; ++jDiag) {
+	  auto&& ddIt = diags[jDiag];
+	  if (ddIt.isDone()) continue;
+	  ddIt.replaceSubexpression(std::get<0>(globOptStep),
+				    std::get<1>(globOptStep),
+				    std::get<2>(globOptStep));
 	}
       } // diagram done
+
+      nDiagDone = iDiag + 1;
+      if (!checkpointFile.empty() && std::chrono::duration<double>(
+	    std::chrono::steady_clock::now() - lastCheckpoint).count() > checkpointInterval) {
+	tuneReport.tuneTime = std::chrono::duration<double>(
+	      std::chrono::steady_clock::now() - tuneStart).count();
+	_writeCheckpoint(_getDiagramList(diags));
+	lastCheckpoint = std::chrono::steady_clock::now();
+      }
     } // diagram list done
+
+    tuneReport.tuneTime = std::chrono::duration<double>(
+	      std::chrono::steady_clock::now() - tuneStart).count();
+    tuneReport.CSECost = CSECost;
+    tuneReport.noCSECost = noCSECost;
+    tuneReport.accumulateCost = accumulateCost;
+
+      // the final state, resuming from it does nothing
+    if (!checkpointFile.empty())
+      _writeCheckpoint(_getDiagramList(diags));
+  }
+
+
+    // complete a diagram taking the first locally optimal step each time,
+    // without looking at other diagrams. Contractions already in the plan
+    // are re-used.
+  template <class DiagRef>
+  void ContractionOptimizer::_tuneLocal(DiagRef&& aDiag, uint rankLimit) {
+    vector<pair<uint, iTup>> stepList;
+    while (!aDiag.isDone()) {
+      unsigned int stepCost = aDiag.singleTermOpt(stepList, rankLimit);
+
+      const auto& aStep = stepList.front();
+      auto sKey = make_tuple(aStep.first, aStep.second.first, aStep.second.second);
+      auto sIt = localStepMap.find(sKey);
+      if (sIt == localStepMap.end()) {
+	sIt = localStepMap.emplace(sKey, ++maxTensId).first;
+	_addStep(make_tuple(aStep.first, aStep.second, maxTensId), stepCost);
+      }
+
+      aDiag.replaceSubexpression(aStep.first, aStep.second, sIt->second);
+    }
+  }
+
+
+    // append a contraction step to the plan, or a view if it forms a
+    // permutation of an existing intermediary
+  void ContractionOptimizer::_addStep(const compStep_t& aStep, uint stepCost) {
+    const iTup& globTensPair = std::get<1>(aStep);
+    uint newRank = tensRankMap[globTensPair.first] + tensRankMap[globTensPair.second]
+		    - 2*Graph::getNumContractions(std::get<0>(aStep));
+    tensRankMap[std::get<2>(aStep)] = newRank;
+
+    if (usePermutationCSE && _matchPermutedIntermediary(aStep))
+      return;
+
+    compStepList.push_back(aStep);
+    CSECost += stepCost;
+    CSECost.updateMaxIntermediateRank(newRank);
+  }
+
+
+    // step code accumulating with the given coefficient
+  uint ContractionOptimizer::_getAccumulateCode(double coeff) {
+    if (coefficientIdMap.size() != coefficientList.size()) {
+      coefficientIdMap.clear();
+      for (uint iC = 0; iC < coefficientList.size(); ++iC)
+	coefficientIdMap.emplace(coefficientList[iC], iC);
+    }
+
+    auto cIt = coefficientIdMap.find(coeff);
+    if (cIt == coefficientIdMap.end()) {
+      if (coefficientList.size() == (1u << 24))
+	throw(std::string("Too many distinct accumulation coefficients."));
+      cIt = coefficientIdMap.emplace(coeff, coefficientList.size()).first;
+      coefficientList.push_back(coeff);
+    }
+    return stepAccumulate | (cIt->second << 8);
+  }
+
+
+    // sum the results of the diagrams of every correlator into one target
+    // with accumulate steps. Where the final contractions of several results
+    // share the step code and one operand, the other operands are summed
+    // first and contracted with the shared one only once. Only diagrams
+    // with a single result take part.
+    //
+    // This is the distributive law on the final contraction of tuned
+    // diagrams, which always pays off; _factoriseDiagrams applies it to
+    // input tensors before tuning, where the whole diagram is contracted
+    // once instead of several times, and is optional since it changes what
+    // the greedy sees.
+  void ContractionOptimizer::_accumulateCorrelators() {
+      // correlator -> (result ID -> sum of the weights of its diagrams), and
+      // the correlators using every result, noCorrelator standing for
+      // diagrams that keep their results
+    std::map<uint, std::map<uint, double>> termMap;
+    std::map<uint, std::set<uint>> resultUseMap;
+    for (const auto& aDiag : diagList) {
+      const auto& resultIdList = aDiag.getResultIdList();
+      uint corrId = aDiag.getCorrelatorId();
+      if (corrId == Diagram::noCorrelator || resultIdList.size() != 1) {
+	for (auto rId : resultIdList)
+	  resultUseMap[rId].insert(Diagram::noCorrelator);
+	continue;
+      }
+      termMap[corrId][resultIdList.front()] += aDiag.getWeight();
+      resultUseMap[resultIdList.front()].insert(corrId);
+    }
+    if (termMap.empty()) return;
+
+    std::map<uint, std::list<compStep_t>::iterator> producerMap;
+    std::set<uint> operandSet;
+    for (auto sIt = compStepList.begin(); sIt != compStepList.end(); ++sIt) {
+      producerMap[std::get<2>(*sIt)] = sIt;
+      operandSet.insert(std::get<1>(*sIt).first);
+      operandSet.insert(std::get<1>(*sIt).second);
+    }
+
+    auto isView = [&producerMap](uint tensId) {
+      auto pIt = producerMap.find(tensId);
+      return pIt != producerMap.end() && getStepKind(std::get<0>(*pIt->second)) == stepPermute;
+    };
+
+    std::list<compStep_t> accStepList;
+    std::map<uint, uint> targetMap;
+    for (auto& cIt : termMap) {
+      uint targetId = ++maxTensId;
+      tensRankMap[targetId] = 0;
+      targetMap[cIt.first] = targetId;
+      tuneReport.nCorrelators++;
+
+	// results whose final contraction can be factorised: formed by a
+	// contraction of non-view operands, used by no other step and by no
+	// diagram outside this correlator
+      std::set<uint> candidateSet;
+      for (auto tIt : cIt.second) {
+	auto pIt = producerMap.find(tIt.first);
+	if (pIt == producerMap.end() || operandSet.count(tIt.first)
+	    || resultUseMap.at(tIt.first).size() != 1 || tensRankMap.at(tIt.first) != 0
+	    || getStepKind(std::get<0>(*pIt->second)) != stepContract)
+	  continue;
+	const iTup& globTensPair = std::get<1>(*pIt->second);
+	if (!isView(globTensPair.first) && !isView(globTensPair.second))
+	  candidateSet.insert(tIt.first);
+      }
+
+	// group by the shared second operand first, then by the shared first
+	// one; iSide is the position of the summed operand in the pair
+      for (uint iSide = 0; iSide < 2; ++iSide) {
+	std::map<std::pair<uint, uint>, std::vector<uint>> groupMap;
+	for (auto rId : candidateSet) {
+	  const compStep_t& aStep = *producerMap.at(rId);
+	  uint sharedId = (iSide == 0) ? std::get<1>(aStep).second : std::get<1>(aStep).first;
+	  groupMap[std::make_pair(std::get<0>(aStep), sharedId)].push_back(rId);
+	}
+
+	for (const auto& gIt : groupMap) {
+	  uint stepCode = gIt.first.first, sharedId = gIt.first.second;
+	  if (gIt.second.size() < 2) continue;
+
+	    // both operands of a final contraction have rank nContr, so k
+	    // contractions become k accumulations of the same size, with a
+	    // real instead of a complex factor, and a single contraction.
+	    // The accumulations go to accumulateCost, CSECost drops by k-1
+	    // contractions.
+	  uint nContr = Graph::getNumContractions(stepCode);
+	  uint sumRank = nContr;
+
+	  uint sumId = ++maxTensId;
+	  tensRankMap[sumId] = sumRank;
+	  for (auto rId : gIt.second) {
+	    auto pIt = producerMap.at(rId);
+	    const iTup& globTensPair = std::get<1>(*pIt);
+	    uint termId = (iSide == 0) ? globTensPair.first : globTensPair.second;
+	    accStepList.push_back(std::make_tuple(_getAccumulateCode(cIt.second.at(rId)),
+						  iTup(termId, termId), sumId));
+	    accumulateCost += sumRank;
+
+	    ContractionCost removedCost;
+	    removedCost += nContr;
+	    CSECost -= removedCost;
+	    compStepList.erase(pIt);
+	    producerMap.erase(rId);
+	    tensRankMap.erase(rId);
+	    candidateSet.erase(rId);
+	    cIt.second.erase(rId);
+	  }
+	  CSECost.updateMaxIntermediateRank(sumRank);
+
+	  uint productId = ++maxTensId;
+	  tensRankMap[productId] = 0;
+	  accStepList.push_back(std::make_tuple(stepCode,
+	  	(iSide == 0) ? iTup(sumId, sharedId) : iTup(sharedId, sumId), productId));
+	  CSECost += nContr;
+	  cIt.second[productId] = 1.;
+	  tuneReport.nFactorised += gIt.second.size() - 1;
+	}
+      }
+
+	// everything else goes straight into the target; scalar views are
+	// read from the underlying tensor, as their own copy is made last
+      for (auto tIt : cIt.second) {
+	uint termId = tIt.first;
+	if (isView(termId))
+	  termId = std::get<1>(*producerMap.at(termId)).first;
+	accStepList.push_back(std::make_tuple(_getAccumulateCode(tIt.second),
+					      iTup(termId, termId), targetId));
+      }
+    }
+    compStepList.splice(compStepList.end(), accStepList);
+
+    for (auto& aDiag : diagList) {
+      uint corrId = aDiag.getCorrelatorId();
+      if (corrId == Diagram::noCorrelator || aDiag.getResultIdList().size() != 1)
+	continue;
+      Diagram accDiag(aDiag.getGraph(), aDiag.getRemainingTensors(),
+		      std::vector<uint>(1, targetMap.at(corrId)));
+      accDiag.setCorrelator(corrId, aDiag.getWeight());
+      aDiag = std::move(accDiag);
+    }
+
+    tuneReport.CSECost = CSECost;
+    tuneReport.accumulateCost = accumulateCost;
+  }
+
+
+    // a diagram with several connected components has one result each, and
+    // is not linear in any single tensor
+  static bool _isConnected(const Graph& aGraph, uint nTens) {
+    uint parent[16];
+    std::iota(parent, parent + nTens, 0);
+    auto getRoot = [&parent](uint tId) {
+      while (parent[tId] != tId) tId = parent[tId] = parent[parent[tId]];
+      return tId;
+    };
+
+    uint nComponents = nTens;
+    for (auto aCode : aGraph.__hash__()) {
+      uint root1 = getRoot((aCode >> 4) & 0xfu), root2 = getRoot(aCode & 0xfu);
+      if (root1 == root2) continue;
+      parent[root1] = root2;
+      nComponents--;
+    }
+    return nComponents == 1;
+  }
+
+    // splits the cost of the greedy path of a diagram into the steps that
+    // involve tensor sumId, directly or through an intermediary, and the
+    // others; IDs from nextId on are used for the intermediaries. Among the
+    // locally optimal steps one not involving sumId is taken, as the global
+    // profit of tune() would for a group of diagrams differing in sumId
+  static void _splitRemainingCost(Diagram aDiag, uint sumId, uint rankLimit, uint nextId,
+				  ContractionCost& sharedCost, ContractionCost& dependentCost) {
+    std::set<uint> dependentSet{sumId};
+    auto isDependent = [&dependentSet](const pair<uint, iTup>& aStep) {
+      return dependentSet.count(aStep.second.first) || dependentSet.count(aStep.second.second);
+    };
+
+    vector<pair<uint, iTup>> stepList;
+    while (!aDiag.isDone()) {
+      unsigned int stepCost = aDiag.singleTermOpt(stepList, rankLimit);
+
+      auto sIt = std::find_if_not(stepList.begin(), stepList.end(), isDependent);
+      if (sIt == stepList.end()) {
+	sIt = stepList.begin();
+	dependentCost += stepCost;
+	dependentSet.insert(nextId);
+      }
+      else
+	sharedCost += stepCost;
+      aDiag.replaceSubexpression(sIt->first, sIt->second, nextId++);
+    }
+  }
+
+    // distributive law across diagrams: w1 D(..., B, ...) + w2 D(..., C, ...)
+    // = w1 D(..., B + w2/w1 C, ...). Diagrams of a correlator are grouped by
+    // their graph and tensors with one tensor left out, and every group is
+    // merged into its first diagram, the others becoming copies of weight 0.
+    // Sums over the same terms are formed once, and merged diagrams may be
+    // merged again in later rounds.
+  void ContractionOptimizer::_factoriseDiagrams() {
+    const uint placeholderId = ~0u;
+    size_t nDiag = diagList.size();
+    uint rankLimit = _getRankLimit();
+
+    for (const auto& aDiag : diagList)
+      for (auto tId : aDiag.getRemainingTensors())
+	maxTensId = max(maxTensId, tId);
+    for (auto tIt : tensRankMap)
+      maxTensId = max(maxTensId, tIt.first);
+
+      // index of the diagram every diagram was merged into, itself if none
+    std::vector<size_t> mergedInto(nDiag);
+    std::iota(mergedInto.begin(), mergedInto.end(), 0);
+    std::vector<bool> isCandidate(nDiag);
+    for (size_t iD = 0; iD < nDiag; ++iD) {
+      const Diagram& aDiag = diagList[iD];
+      isCandidate[iD] = aDiag.getCorrelatorId() != Diagram::noCorrelator
+			&& aDiag.getWeight() != 0. && !aDiag.isDone()
+			&& _isConnected(aDiag.getGraph(), aDiag.getRemainingTensors().size());
+    }
+
+      // (term ID, coefficient) list -> ID of the sum tensor
+    std::map<std::vector<std::pair<uint, double>>, uint> sumIdMap;
+
+    for (bool isMerged = true; isMerged; ) {
+      isMerged = false;
+
+	// (correlator, graph, tensor IDs) with one tensor replaced by the
+	// placeholder -> (diagram, ID of the replaced tensor, its rank)
+      std::map<std::tuple<uint, std::vector<unsigned int>, std::vector<uint>>,
+	       std::vector<std::tuple<size_t, uint, uint>>> groupMap;
+      for (size_t iD = 0; iD < nDiag; ++iD) {
+	if (!isCandidate[iD]) continue;
+	const Diagram& aDiag = diagList[iD];
+	const auto& tensIdList = aDiag.getRemainingTensors();
+	auto rankList = aDiag.getGraph().getAllNumInds();
+
+	for (uint iT = 0; iT < tensIdList.size(); ++iT) {
+	  if (iT > 0 && tensIdList[iT] == tensIdList[iT-1]) continue;
+	  std::vector<uint> maskedIdList(tensIdList);
+	  maskedIdList[iT] = placeholderId;
+	  Diagram masked(aDiag.getGraph(), std::move(maskedIdList));
+	  groupMap[std::make_tuple(aDiag.getCorrelatorId(), masked.getGraph().__hash__(),
+				   masked.getRemainingTensors())]
+	    .push_back(std::make_tuple(iD, tensIdList[iT], rankList[iT]));
+	}
+      }
+
+	// a diagram takes part in one merge per round
+      std::vector<bool> isUsed(nDiag, false);
+      for (const auto& gIt : groupMap) {
+	std::vector<std::tuple<size_t, uint, uint>> memberList;
+	for (const auto& aMember : gIt.second)
+	  if (!isUsed[std::get<0>(aMember)]) memberList.push_back(aMember);
+	if (memberList.size() < 2) continue;
+
+	  // weighted terms relative to the weight of the first diagram,
+	  // repeated terms combined
+	size_t firstDiag = std::get<0>(memberList.front());
+	double firstWeight = diagList[firstDiag].getWeight();
+	std::map<uint, double> termMap;
+	for (const auto& aMember : memberList)
+	  termMap[std::get<1>(aMember)] += diagList[std::get<0>(aMember)].getWeight() / firstWeight;
+	if (termMap.size() < 2) continue;
+
+	std::vector<std::pair<uint, double>> termList(termMap.begin(), termMap.end());
+	uint sumRank = std::get<2>(memberList.front());
+	auto sIt = sumIdMap.find(termList);
+
+	  // merge only if the additions forming the sum are cheaper than what
+	  // merging saves. Tuned as it is, CSE shares the steps of the group
+	  // that do not involve the differing tensor, and repeats the others
+	  // for every term; the merged diagram does these only once
+	std::vector<uint> tensIdList(std::get<2>(gIt.first));
+	*std::find(tensIdList.begin(), tensIdList.end(), placeholderId) = maxTensId + 1;
+	Diagram merged(Graph(std::get<1>(gIt.first)), std::move(tensIdList));
+	ContractionCost sharedCost, dependentCost, savedCost, additionCost;
+	_splitRemainingCost(merged, maxTensId + 1, rankLimit, maxTensId + 2, sharedCost, dependentCost);
+	for (size_t iT = 1; iT < termList.size(); ++iT) savedCost += dependentCost;
+	if (sIt == sumIdMap.end() && sumRank > 0)
+	  for (size_t iT = 0; iT < termList.size(); ++iT) additionCost += sumRank;
+	if (!(additionCost < savedCost)) continue;
+
+	if (sIt == sumIdMap.end()) {
+	  sIt = sumIdMap.emplace(termList, ++maxTensId).first;
+	  tensRankMap[maxTensId] = sumRank;
+	  for (auto tIt : termList) {
+	    tensRankMap[tIt.first] = sumRank;
+	    compStepList.push_back(std::make_tuple(_getAccumulateCode(tIt.second),
+						   iTup(tIt.first, tIt.first), maxTensId));
+	    if (sumRank > 0) accumulateCost += sumRank;
+	  }
+	  CSECost.updateMaxIntermediateRank(sumRank);
+	}
+
+	tensIdList = std::get<2>(gIt.first);
+	*std::find(tensIdList.begin(), tensIdList.end(), placeholderId) = sIt->second;
+	merged = Diagram(Graph(std::get<1>(gIt.first)), std::move(tensIdList));
+	merged.setCorrelator(std::get<0>(gIt.first), firstWeight);
+	diagList[firstDiag] = std::move(merged);
+
+	for (const auto& aMember : memberList) {
+	  size_t iD = std::get<0>(aMember);
+	  isUsed[iD] = true;
+	  if (iD == firstDiag) continue;
+	  mergedInto[iD] = firstDiag;
+	  isCandidate[iD] = false;
+	  tuneReport.nDiagMerged++;
+	}
+	isMerged = true;
+      }
+    }
+
+      // merged diagrams become copies of the diagram they ended up in, so
+      // that tune() gives them the same result
+    for (size_t iD = 0; iD < nDiag; ++iD) {
+      if (mergedInto[iD] == iD) continue;
+      size_t target = iD;
+      while (mergedInto[target] != target) target = mergedInto[target];
+      Diagram copy(diagList[target]);
+      copy.setCorrelator(diagList[target].getCorrelatorId(), 0.);
+      diagList[iD] = std::move(copy);
+    }
+  }
+
+
+    // binary checkpoints: fixed-size values are written as they are in
+    // memory, vectors as their length followed by their elements
+  template <class T>
+  static void _writeValue(std::ostream& out, const T& val) {
+    out.write(reinterpret_cast<const char*>(&val), sizeof(T));
+  }
+
+  template <class T>
+  static void _writeVector(std::ostream& out, const std::vector<T>& vec) {
+    _writeValue(out, uint64_t(vec.size()));
+    out.write(reinterpret_cast<const char*>(vec.data()), vec.size()*sizeof(T));
+  }
+
+  template <class T>
+  static void _readValue(std::istream& in, T& val) {
+    in.read(reinterpret_cast<char*>(&val), sizeof(T));
+    if (!in)
+      throw(std::string("Truncated checkpoint file."));
+  }
+
+  template <class T>
+  static void _readVector(std::istream& in, std::vector<T>& vec) {
+    uint64_t size;
+    _readValue(in, size);
+    vec.resize(size);
+    in.read(reinterpret_cast<char*>(vec.data()), size*sizeof(T));
+    if (!in)
+      throw(std::string("Truncated checkpoint file."));
+  }
+
+  static void _writeCost(std::ostream& out, const ContractionCost& cost) {
+    _writeVector(out, cost.getCostArray());
+    _writeValue(out, cost.getMaxIntermediateRank());
+  }
+
+  static ContractionCost _readCost(std::istream& in) {
+    std::vector<unsigned int> store;
+    unsigned int maxIntermediateRank;
+    _readVector(in, store);
+    _readValue(in, maxIntermediateRank);
+    return ContractionCost(std::move(store), maxIntermediateRank);
+  }
+
+  static const char checkpointMagic[8] = {'C','O','N','T','R','C','K','4'};
+
+
+  void ContractionOptimizer::_writeCheckpoint(const std::vector<Diagram>& curDiagList) const {
+      // write to a temporary file first, so that an interrupted write
+      // leaves the previous checkpoint intact
+    std::string tmpFile = checkpointFile + ".tmp";
+    std::ofstream out(tmpFile, std::ios::binary | std::ios::trunc);
+    if (!out)
+      throw(std::string("Cannot write checkpoint ") + tmpFile);
+
+    out.write(checkpointMagic, sizeof(checkpointMagic));
+
+      // settings
+    _writeValue(out, ContractionCost::getDilutionRange());
+    _writeValue(out, useDiagramStore);
+    _writeValue(out, maxRank);
+    _writeValue(out, uint64_t(memoryBudget));
+    _writeValue(out, uint64_t(bytesPerElement));
+    _writeValue(out, usePermutationCSE);
+    _writeValue(out, useFactorisation);
+    _writeValue(out, timeBudget);
+    _writeValue(out, maxCandidates);
+    _writeValue(out, sampleFraction);
+
+      // progress and results so far
+    _writeValue(out, uint64_t(nDiagDone));
+    _writeValue(out, maxTensId);
+    _writeValue(out, tuneReport.tuneTime);
+    _writeValue(out, tuneReport.budgetExhausted);
+    _writeValue(out, uint64_t(tuneReport.nDiagGlobal));
+    _writeValue(out, uint64_t(tuneReport.nDiagLocal));
+    _writeValue(out, uint64_t(tuneReport.nDiagMerged));
+    _writeCost(out, CSECost);
+    _writeCost(out, noCSECost);
+    _writeCost(out, accumulateCost);
+
+    _writeValue(out, uint64_t(curDiagList.size()));
+    for (const auto& aDiag : curDiagList) {
+      _writeVector(out, aDiag.getGraph().__hash__());
+      _writeVector(out, aDiag.getRemainingTensors());
+      _writeVector(out, aDiag.getResultIdList());
+      _writeValue(out, aDiag.getCorrelatorId());
+      _writeValue(out, aDiag.getWeight());
+    }
+
+    _writeValue(out, uint64_t(compStepList.size()));
+    for (const auto& aStep : compStepList) {
+      _writeValue(out, std::get<0>(aStep));
+      _writeValue(out, std::get<1>(aStep).first);
+      _writeValue(out, std::get<1>(aStep).second);
+      _writeValue(out, std::get<2>(aStep));
+    }
+    _writeVector(out, coefficientList);
+
+    _writeValue(out, uint64_t(tensRankMap.size()));
+    for (auto tIt : tensRankMap) {
+      _writeValue(out, tIt.first);
+      _writeValue(out, tIt.second);
+    }
+
+      // permutation-aware CSE and local step bookkeeping
+    _writeValue(out, uint64_t(signatureMap.size()));
+    for (const auto& sIt : signatureMap) {
+      _writeValue(out, sIt.first);
+      _writeVector(out, sIt.second.leafList);
+      _writeVector(out, sIt.second.edgeList);
+      _writeVector(out, sIt.second.freeList);
+    }
+
+    _writeValue(out, uint64_t(signatureIdMap.size()));
+    for (const auto& sIt : signatureIdMap) {
+      _writeVector(out, sIt.first);
+      _writeValue(out, sIt.second);
+    }
+
+    _writeValue(out, uint64_t(localStepMap.size()));
+    for (auto sIt : localStepMap) {
+      _writeValue(out, std::get<0>(sIt.first));
+      _writeValue(out, std::get<1>(sIt.first));
+      _writeValue(out, std::get<2>(sIt.first));
+      _writeValue(out, sIt.second);
+    }
+
+    out.close();
+    if (!out || std::rename(tmpFile.c_str(), checkpointFile.c_str()) != 0)
+      throw(std::string("Cannot write checkpoint ") + checkpointFile);
+  }
+
+
+  void ContractionOptimizer::_readCheckpoint(const std::string& fileName) {
+    std::ifstream in(fileName, std::ios::binary);
+    if (!in)
+      throw(std::string("Cannot read checkpoint ") + fileName);
+
+    char magic[sizeof(checkpointMagic)];
+    in.read(magic, sizeof(magic));
+    if (!in || !std::equal(magic, magic + sizeof(magic), checkpointMagic))
+      throw(fileName + std::string(" is not a checkpoint file."));
+
+      // settings
+    unsigned int nDil;
+    uint64_t u64;
+    _readValue(in, nDil);
+    if (ContractionCost::getDilutionRange() == 0)
+      ContractionCost::setDilutionRange(nDil);
+    else if (ContractionCost::getDilutionRange() != nDil)
+      throw(std::string("Dilution range differs from the one of the checkpoint."));
+    _readValue(in, useDiagramStore);
+    _readValue(in, maxRank);
+    _readValue(in, u64); memoryBudget = u64;
+    _readValue(in, u64); bytesPerElement = u64;
+    _readValue(in, usePermutationCSE);
+    _readValue(in, useFactorisation);
+    _readValue(in, timeBudget);
+    _readValue(in, maxCandidates);
+    _readValue(in, sampleFraction);
+
+      // progress and results so far
+    _readValue(in, u64); nDiagDone = u64;
+    _readValue(in, maxTensId);
+    tuneReport = TuneReport();
+    _readValue(in, tuneReport.tuneTime);
+    _readValue(in, tuneReport.budgetExhausted);
+    _readValue(in, u64); tuneReport.nDiagGlobal = u64;
+    _readValue(in, u64); tuneReport.nDiagLocal = u64;
+    _readValue(in, u64); tuneReport.nDiagMerged = u64;
+    CSECost = _readCost(in);
+    noCSECost = _readCost(in);
+    accumulateCost = _readCost(in);
+
+    uint64_t nEntries;
+    _readValue(in, nEntries);
+    diagList.clear();
+    diagList.reserve(nEntries);
+    for (uint64_t iE = 0; iE < nEntries; ++iE) {
+      std::vector<unsigned int> icode;
+      std::vector<uint> tensIdList, resultIdList;
+      _readVector(in, icode);
+      _readVector(in, tensIdList);
+      _readVector(in, resultIdList);
+      uint corrId;
+      double weight;
+      _readValue(in, corrId);
+      _readValue(in, weight);
+      diagList.push_back(Diagram(Graph(std::move(icode)), std::move(tensIdList),
+				 std::move(resultIdList)));
+      diagList.back().setCorrelator(corrId, weight);
+    }
+
+    _readValue(in, nEntries);
+    compStepList.clear();
+    for (uint64_t iE = 0; iE < nEntries; ++iE) {
+      uint stepCode, tensId1, tensId2, newId;
+      _readValue(in, stepCode);
+      _readValue(in, tensId1);
+      _readValue(in, tensId2);
+      _readValue(in, newId);
+      compStepList.push_back(std::make_tuple(stepCode, iTup(tensId1, tensId2), newId));
+    }
+    _readVector(in, coefficientList);
+
+    _readValue(in, nEntries);
+    tensRankMap.clear();
+    for (uint64_t iE = 0; iE < nEntries; ++iE) {
+      uint tensId, rank;
+      _readValue(in, tensId);
+      _readValue(in, rank);
+      tensRankMap.emplace(tensId, rank);
+    }
+
+      // permutation-aware CSE and local step bookkeeping
+    _readValue(in, nEntries);
+    signatureMap.clear();
+    for (uint64_t iE = 0; iE < nEntries; ++iE) {
+      uint tensId;
+      _readValue(in, tensId);
+      tensSignature_t& aSig = signatureMap[tensId];
+      _readVector(in, aSig.leafList);
+      _readVector(in, aSig.edgeList);
+      _readVector(in, aSig.freeList);
+    }
+
+    _readValue(in, nEntries);
+    signatureIdMap.clear();
+    for (uint64_t iE = 0; iE < nEntries; ++iE) {
+      std::vector<uint64_t> sigKey;
+      uint tensId;
+      _readVector(in, sigKey);
+      _readValue(in, tensId);
+      signatureIdMap.emplace(std::move(sigKey), tensId);
+    }
+
+    _readValue(in, nEntries);
+    localStepMap.clear();
+    for (uint64_t iE = 0; iE < nEntries; ++iE) {
+      uint stepCode, tensId1, tensId2, newId;
+      _readValue(in, stepCode);
+      _readValue(in, tensId1);
+      _readValue(in, tensId2);
+      _readValue(in, newId);
+      localStepMap.emplace(std::make_tuple(stepCode, tensId1, tensId2), newId);
+    }
   }
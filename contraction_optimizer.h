@@ -2,32 +2,220 @@
 #define CONTRACTION_OPTIMIZER_H
 
 #include "diagram.h"
+#include "diagram_store.h"
 #include <list>
+#include <string>
+#include <random>
+#include <cstdint>
 
 
 typedef std::tuple<uint, iTup, uint>  compStep_t;
 
+  // the lowest byte of the step code of a compStep_t tells the kind of step
+  // 	stepContract: contraction of the tensor pair, the index pairs are
+  // 		encoded in the upper bits as in Graph
+  // 	stepPermute: the new tensor is a permuted view of the first tensor of
+  // 		the pair (both entries of the pair are the same); index k of the
+  // 		view is index perm[k] of the tensor, perm[k] stored in 3 bits
+  // 		at position 8 + 3*k
+  // 	stepAccumulate: the new tensor is incremented by a coefficient times
+  // 		the first tensor of the pair (both entries of the pair are the
+  // 		same, and of the same rank as the new tensor). Several steps
+  // 		may accumulate into the same tensor, which starts out as zero.
+  // 		The coefficient is ContractionOptimizer::getCoefficient of
+  // 		the step code, its index stored from bit 8
+enum compStepKind : uint { stepContract = 0x0u, stepPermute = 0x1u, stepAccumulate = 0x2u };
+
+
+  // summary of a call to ContractionOptimizer::tune
+struct TuneReport {
+  double tuneTime;		// wall-clock time in seconds
+  bool budgetExhausted;		// time budget ran out before the end
+  size_t nDiagGlobal;		// diagrams begun with the global greedy
+  size_t nDiagLocal;		// diagrams completed with local steps only
+  ContractionCost CSECost, noCSECost;
+  ContractionCost accumulateCost;	// see getAccumulateCost
+  uint nRestarts;		// tunes run by tuneRandomised, 1 otherwise
+  uint bestRestart;		// the one whose plan was kept
+  size_t nCorrelators;		// accumulation targets formed for correlators
+  size_t nFactorised;		// final contractions saved by factorised sums
+  size_t nDiagMerged;		// diagrams merged into others by factorisation
+
+  TuneReport() : tuneTime(0.), budgetExhausted(false), nDiagGlobal(0), nDiagLocal(0),
+		 nRestarts(1), bestRestart(0), nCorrelators(0), nFactorised(0),
+		 nDiagMerged(0) {}
+};
+
 class ContractionOptimizer {
 
   private:
     std::vector<Diagram> diagList;
     std::list<compStep_t> compStepList;
     ContractionCost CSECost, noCSECost;
+      // real-weighted additions of the stepAccumulate steps, counted apart
+      // from the complex contractions in CSECost
+    ContractionCost accumulateCost;
+    bool useDiagramStore;
+      // limits on the size of intermediaries, 0 meaning no limit
+    uint maxRank;
+    size_t memoryBudget, bytesPerElement;
+      // rank of every global tensor, leaves as well as intermediaries
+    std::map<uint, uint> tensRankMap;
+
+      // content of a tensor for permutation-aware CSE: the input tensors it
+      // is made of, the index pairs contracted among them, and its remaining
+      // indices in order. An index is encoded as (input tensor ID << 3 | slot)
+    struct tensSignature_t {
+      std::vector<uint64_t> leafList;
+      std::vector<std::pair<uint64_t, uint64_t>> edgeList;
+      std::vector<uint64_t> freeList;
+    };
+    bool usePermutationCSE;
+      // merge diagrams of a correlator differing in one tensor before tuning
+    bool useFactorisation;
+    std::map<uint, tensSignature_t> signatureMap;
+    std::map<std::vector<uint64_t>, uint> signatureIdMap;
+
+      // anytime tuning: wall-clock budget in seconds (0: none), number of
+      // candidate steps evaluated globally (0: all) and fraction of the
+      // remaining diagrams sampled to evaluate the global profit
+    double timeBudget;
+    uint maxCandidates;
+    double sampleFraction;
+    TuneReport tuneReport;
+      // (step code, operand IDs) -> ID for the contractions in the plan once
+      // the local greedy has started
+    std::map<std::tuple<uint, uint, uint>, uint> localStepMap;
+      // periodic snapshots of the tuning state
+    std::string checkpointFile;
+    double checkpointInterval;
+      // position of the greedy: number of diagrams finished, and the
+      // largest tensor ID in use
+    size_t nDiagDone;
+    uint maxTensId;
+      // print progress, and break ties between candidate steps randomly
+    bool verbose;
+    bool randomTieBreak;
+    std::mt19937_64 tieBreakRng;
+      // coefficients of the stepAccumulate steps, and their indices
+    std::vector<double> coefficientList;
+    std::map<double, uint> coefficientIdMap;
+      // keeps the graph caches alive while this optimizer exists
+    GraphCacheHandle cacheHandle;
 
   public:
     ContractionOptimizer(const std::vector<Diagram>& _diagList);
+      // takes ownership of the diagram list without copying it
+    ContractionOptimizer(std::vector<Diagram>&& _diagList);
 
+      // diagrams with a correlator ID (Diagram::setCorrelator) are summed
+      // into one result per correlator after tuning, see README
     void tune();
+      // continue a tune() from the checkpoint in fileName. Diagrams,
+      // settings and results of this optimizer are replaced by those of the
+      // checkpoint, the outcome is that of an uninterrupted tune()
+    void resume(const std::string& fileName);
+      // randomised greedy: run nRestarts tunes on nThreads threads (0: all
+      // cores) and keep the plan with the lowest CSE cost. Restart 0 is the
+      // plain tune(), every other one shuffles the order of the diagrams
+      // and breaks ties between candidate steps randomly, seeded by seed
+      // and its index. The graph caches are shared between all restarts.
+      // Restarts neither print progress nor write checkpoints, even after
+      // setCheckpoint(), so an interrupted run has to be started anew
+    void tuneRandomised(uint nRestarts, uint nThreads = 0, uint64_t seed = 0);
+
+      // replicate a tuned set of template diagrams, e.g. for many time
+      // slices: every map in idMapList translates the input tensor IDs of the
+      // templates to those of one replica, IDs not in a map are shared
+      // between replicas. Afterwards the plan and the diagram list cover
+      // all replicas (replica-major), and steps whose operands coincide
+      // between replicas are performed only once.
+    void replicate(const std::vector<std::map<uint, uint>>& idMapList);
+      // tune on a DiagramStore copy of the diagram list, which keeps tensor
+      // IDs of all diagrams in one contiguous slab
+    void setUseDiagramStore(bool _useDiagramStore) { useDiagramStore = _useDiagramStore; }
+      // avoid intermediaries of rank larger than _maxRank, or larger than
+      // _memoryBudget bytes for a given size of a tensor element (default:
+      // double precision complex). If both are set the tighter one applies.
+    void setMaxIntermediateRank(uint _maxRank) { maxRank = _maxRank; }
+    void setMemoryBudget(size_t _memoryBudget, size_t _bytesPerElement = 16) {
+      memoryBudget = _memoryBudget;
+      bytesPerElement = _bytesPerElement;
+    }
+      // recognize intermediaries that are index permutations of one formed
+      // before, and emit a stepPermute view instead of recomputing them
+    void setPermutationCSE(bool _usePermutationCSE) { usePermutationCSE = _usePermutationCSE; }
+      // distributive law: before tuning, diagrams of the same correlator
+      // which differ in a single input tensor are merged into one diagram
+      // on the weighted sum of these tensors, formed by stepAccumulate
+      // steps. Merged diagrams keep their place in the diagram list with
+      // weight 0, see README
+    void setFactorisation(bool _useFactorisation) { useFactorisation = _useFactorisation; }
+      // when tune() has used up _timeBudget seconds the remaining steps
+      // are taken with the locally best step only, re-using steps that
+      // have been done before. The budget is checked before every step, so
+      // it is overrun by at most one global step
+    void setTimeBudget(double _timeBudget) { timeBudget = _timeBudget; }
+      // trade quality for speed: evaluate the global profit only for the
+      // first _maxCandidates locally optimal steps, and only on a
+      // _sampleFraction of the remaining diagrams
+    void setTuneQuality(uint _maxCandidates, double _sampleFraction = 1.) {
+      maxCandidates = _maxCandidates;
+      sampleFraction = _sampleFraction;
+    }
+      // make tune() write its state to _checkpointFile after finishing a
+      // diagram if the last snapshot is older than _checkpointInterval
+      // seconds, and once more at the end; an empty name disables this
+    void setCheckpoint(const std::string& _checkpointFile, double _checkpointInterval = 600.) {
+      checkpointFile = _checkpointFile;
+      checkpointInterval = _checkpointInterval;
+    }
+      // print the progress of tune() to stdout
+    void setVerbose(bool _verbose) { verbose = _verbose; }
 
-    std::list<compStep_t> getCompStepList() const {return compStepList; }
-    std::vector<Diagram> getDiagramList() const { return diagList; }
+      // read-only views on the results, valid as long as the optimizer lives
+    const std::list<compStep_t>& getCompStepList() const {return compStepList; }
+    const std::vector<Diagram>& getDiagramList() const { return diagList; }
+      // hands the transformed diagram list over to the caller, leaving the
+      // optimizer with an empty list
+    std::vector<Diagram> releaseDiagramList() { return std::move(diagList); }
     ContractionCost getCSECost() const { return CSECost; }
     ContractionCost getNoCSECost() const { return noCSECost; }
+      // one unit of order r per element of a rank-r tensor added with a
+      // real factor; additions into rank-0 tensors are not counted
+    ContractionCost getAccumulateCost() const { return accumulateCost; }
+    const TuneReport& getTuneReport() const { return tuneReport; }
+    const std::map<uint, uint>& getTensorRankMap() const { return tensRankMap; }
+    uint getTensorRank(uint tensId) const { return tensRankMap.at(tensId); }
+
+    static uint getStepKind(uint stepCode) { return stepCode & 0xffu; }
+    double getCoefficient(uint stepCode) const { return coefficientList.at(stepCode >> 8); }
+    const std::vector<double>& getCoefficientList() const { return coefficientList; }
+    static uint encodePermutation(const std::vector<uint>& perm);
+    static std::vector<uint> decodePermutation(uint stepCode, uint nInds);
 
   private:
     ContractionCost get_global_profit(const uint graphStep,
 					  const iTup& globTensPair);
 
+    void _runTune(bool isResumed);
+      // the greedy itself, for std::vector<Diagram> and DiagramStore
+    template <class DiagContainer>
+      void _tune(DiagContainer& diags, bool isResumed);
+    static const std::vector<Diagram>& _getDiagramList(const std::vector<Diagram>& diags) { return diags; }
+    static std::vector<Diagram> _getDiagramList(const DiagramStore& diags) { return diags.getDiagramList(); }
+    void _writeCheckpoint(const std::vector<Diagram>& curDiagList) const;
+    void _readCheckpoint(const std::string& fileName);
+    uint _getRankLimit() const;
+    const tensSignature_t& _getSignature(uint tensId);
+    bool _matchPermutedIntermediary(const compStep_t& aStep);
+    void _addStep(const compStep_t& aStep, uint stepCost);
+    uint _getAccumulateCode(double coeff);
+    void _accumulateCorrelators();
+    void _factoriseDiagrams();
+    template <class DiagRef>
+      void _tuneLocal(DiagRef&& aDiag, uint rankLimit);
+
 };
 
 
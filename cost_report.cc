@@ -0,0 +1,204 @@
+#include "cost_report.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+
+using namespace std;
+
+
+  /*
+   *
+   * 	CostReport implementation
+   *
+   */
+
+
+  CostReport::CostReport(const ContractionOptimizer& cOp) : totalCost(0.) {
+    double nDil = ContractionCost::getDilutionRange();
+    if (nDil == 0)
+      throw(std::string("Must set dilution range first."));
+
+      // step list with costs, and where to find the steps forming a tensor,
+      // several for an accumulation target
+    map<uint, vector<size_t>> producerMap;
+    for (const auto& aStep : cOp.getCompStepList()) {
+      stepCost_t aCost;
+      aCost.step = aStep;
+      aCost.costOrder = 0;
+      aCost.nDirectUses = 0;
+
+      uint stepCode = std::get<0>(aStep);
+      if (ContractionOptimizer::getStepKind(stepCode) == stepContract)
+	aCost.costOrder = cOp.getTensorRank(std::get<1>(aStep).first)
+			  + cOp.getTensorRank(std::get<1>(aStep).second)
+			  - Graph::getNumContractions(stepCode);
+      else if (ContractionOptimizer::getStepKind(stepCode) == stepAccumulate)
+	aCost.costOrder = cOp.getTensorRank(std::get<2>(aStep));
+      aCost.cost = (aCost.costOrder > 0) ? std::pow(nDil, aCost.costOrder) : 0.;
+
+      producerMap[std::get<2>(aStep)].push_back(stepList.size());
+      stepList.push_back(std::move(aCost));
+    }
+
+    auto addDirectUse = [&](uint tensId) {
+      auto pIt = producerMap.find(tensId);
+      if (pIt != producerMap.end())
+	for (auto iStep : pIt->second) stepList[iStep].nDirectUses++;
+    };
+
+    for (auto& aCost : stepList) {
+      const iTup& globTensPair = std::get<1>(aCost.step);
+      addDirectUse(globTensPair.first);
+	// views and accumulations name their operand twice
+      if (globTensPair.second != globTensPair.first)
+	addDirectUse(globTensPair.second);
+    }
+
+      // collect the steps consumed by every diagram, walking back from its
+      // results; lastVisit avoids counting a step twice for one diagram.
+      // Diagrams of weight 0, the copies left by factorisation, come last
+      // and only share the steps no weighted diagram consumes, so that they
+      // do not dilute the cost of the diagrams they were merged into
+    const auto& diagList = cOp.getDiagramList();
+    vector<size_t> lastVisit(stepList.size(), 0);
+    vector<bool> isWeightedStep(stepList.size(), false);
+    vector<vector<size_t>> diagStepList(diagList.size()), diagShareList(diagList.size());
+
+    auto collectSteps = [&](size_t iDiag) {
+      bool isWeighted = (diagList[iDiag].getWeight() != 0.);
+      vector<uint> pendingIds(diagList[iDiag].getResultIdList());
+
+      while (!pendingIds.empty()) {
+	uint tensId = pendingIds.back();
+	pendingIds.pop_back();
+
+	auto pIt = producerMap.find(tensId);
+	if (pIt == producerMap.end()) continue;
+	for (auto iStep : pIt->second) {
+	  if (lastVisit[iStep] == iDiag + 1) continue;
+	  lastVisit[iStep] = iDiag + 1;
+
+	  stepCost_t& aCost = stepList[iStep];
+	  diagStepList[iDiag].push_back(iStep);
+	  if (isWeighted || !isWeightedStep[iStep]) {
+	    aCost.consumerList.push_back(iDiag);
+	    diagShareList[iDiag].push_back(iStep);
+	  }
+	  if (isWeighted) isWeightedStep[iStep] = true;
+	  pendingIds.push_back(std::get<1>(aCost.step).first);
+	  pendingIds.push_back(std::get<1>(aCost.step).second);
+	}
+      }
+    };
+
+    for (size_t iDiag = 0; iDiag < diagList.size(); ++iDiag) {
+      if (!diagList[iDiag].isDone())
+	throw(std::string("Must tune diagrams before reporting their cost."));
+      for (auto rId : diagList[iDiag].getResultIdList())
+	addDirectUse(rId);
+      if (diagList[iDiag].getWeight() != 0.) collectSteps(iDiag);
+    }
+    for (size_t iDiag = 0; iDiag < diagList.size(); ++iDiag)
+      if (diagList[iDiag].getWeight() == 0.) collectSteps(iDiag);
+
+      // consumer lists in diagram order
+    for (auto& aCost : stepList)
+      std::sort(aCost.consumerList.begin(), aCost.consumerList.end());
+
+    diagramList.reserve(diagList.size());
+    for (size_t iDiag = 0; iDiag < diagList.size(); ++iDiag) {
+      diagramCost_t aCost;
+      aCost.resultIdList = diagList[iDiag].getResultIdList();
+      aCost.nSteps = diagStepList[iDiag].size();
+      aCost.standaloneCost = aCost.amortisedCost = 0.;
+      for (auto iStep : diagStepList[iDiag])
+	aCost.standaloneCost += stepList[iStep].cost;
+      for (auto iStep : diagShareList[iDiag])
+	aCost.amortisedCost += stepList[iStep].cost / stepList[iStep].consumerList.size();
+      diagramList.push_back(std::move(aCost));
+    }
+
+    for (const auto& aCost : stepList)
+      if (!aCost.consumerList.empty()) totalCost += aCost.cost;
+  }
+
+
+  static const char* _getKindName(uint stepCode) {
+    switch (ContractionOptimizer::getStepKind(stepCode)) {
+      case stepPermute: return "permute";
+      case stepAccumulate: return "accumulate";
+      default: return "contract";
+    }
+  }
+
+  template <class T>
+  static void _writeIdList(std::ostream& out, const std::vector<T>& idList,
+			   const char* sep) {
+    for (size_t iI = 0; iI < idList.size(); ++iI)
+      out << (iI > 0 ? sep : "") << idList[iI];
+  }
+
+
+    // costs are exported at full double precision, so that they add up to
+    // the total; the precision of out is restored afterwards
+  void CostReport::writeStepCSV(std::ostream& out) const {
+    auto oldPrecision = out.precision(17);
+    out << "step,kind,tensor1,tensor2,result,cost_order,cost,direct_uses,n_consumers,savings,consumers\n";
+    for (size_t iStep = 0; iStep < stepList.size(); ++iStep) {
+      const stepCost_t& aCost = stepList[iStep];
+      out << iStep << ","
+	  << _getKindName(std::get<0>(aCost.step)) << ","
+	  << std::get<1>(aCost.step).first << "," << std::get<1>(aCost.step).second << ","
+	  << std::get<2>(aCost.step) << "," << aCost.costOrder << "," << aCost.cost << ","
+	  << aCost.nDirectUses << "," << aCost.consumerList.size() << ","
+	  << aCost.getSavings() << ",\"";
+      _writeIdList(out, aCost.consumerList, " ");
+      out << "\"\n";
+    }
+    out.precision(oldPrecision);
+  }
+
+  void CostReport::writeDiagramCSV(std::ostream& out) const {
+    auto oldPrecision = out.precision(17);
+    out << "diagram,results,n_steps,standalone_cost,amortised_cost\n";
+    for (size_t iDiag = 0; iDiag < diagramList.size(); ++iDiag) {
+      const diagramCost_t& aCost = diagramList[iDiag];
+      out << iDiag << ",\"";
+      _writeIdList(out, aCost.resultIdList, " ");
+      out << "\"," << aCost.nSteps << "," << aCost.standaloneCost << ","
+	  << aCost.amortisedCost << "\n";
+    }
+    out.precision(oldPrecision);
+  }
+
+  void CostReport::writeJSON(std::ostream& out) const {
+    auto oldPrecision = out.precision(17);
+    out << "{\n  \"total_cost\": " << totalCost << ",\n  \"steps\": [\n";
+    for (size_t iStep = 0; iStep < stepList.size(); ++iStep) {
+      const stepCost_t& aCost = stepList[iStep];
+      out << "    {\"kind\": \""
+	  << _getKindName(std::get<0>(aCost.step))
+	  << "\", \"step_code\": " << std::get<0>(aCost.step)
+	  << ", \"tensors\": [" << std::get<1>(aCost.step).first << ", " << std::get<1>(aCost.step).second
+	  << "], \"result\": " << std::get<2>(aCost.step)
+	  << ", \"cost_order\": " << aCost.costOrder << ", \"cost\": " << aCost.cost
+	  << ", \"direct_uses\": " << aCost.nDirectUses
+	  << ", \"savings\": " << aCost.getSavings() << ", \"consumers\": [";
+      _writeIdList(out, aCost.consumerList, ", ");
+      out << "]}" << (iStep + 1 < stepList.size() ? "," : "") << "\n";
+    }
+    out << "  ],\n  \"diagrams\": [\n";
+    for (size_t iDiag = 0; iDiag < diagramList.size(); ++iDiag) {
+      const diagramCost_t& aCost = diagramList[iDiag];
+      out << "    {\"results\": [";
+      _writeIdList(out, aCost.resultIdList, ", ");
+      out << "], \"n_steps\": " << aCost.nSteps
+	  << ", \"standalone_cost\": " << aCost.standaloneCost
+	  << ", \"amortised_cost\": " << aCost.amortisedCost << "}"
+	  << (iDiag + 1 < diagramList.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    out.precision(oldPrecision);
+  }
@@ -0,0 +1,73 @@
+#ifndef COST_REPORT_H
+#define COST_REPORT_H
+
+#include <ostream>
+#include <vector>
+
+#include "contraction_optimizer.h"
+
+
+
+  // Attributes the cost of a tuned plan to its steps and diagrams. For every
+  // step the report lists the diagrams consuming its result, directly or
+  // through later steps; the cost of a step is shared equally among its
+  // consumers. A diagram is charged its amortised cost, the sum of its
+  // shares, next to its standalone cost, the cost of all steps it consumes
+  // as if nobody else used them. Costs are floating point numbers of
+  // complex multiplications, Ndil^order for a step of cost order `order'.
+  // An accumulation is counted like a multiplication per element of its
+  // target, as in ContractionOptimizer::getAccumulateCost, so the total is
+  // that of getCSECost() plus getAccumulateCost(); all diagrams of a
+  // correlator consume every step accumulating into its target. Diagrams of
+  // weight 0, such as the copies merged away by factorisation, share only
+  // steps that no diagram of nonzero weight consumes. The writers print
+  // costs with 17 significant digits.
+class CostReport {
+
+  public:
+    struct stepCost_t {
+      compStep_t step;
+      uint costOrder;			// 0 for views, which cost nothing,
+					// the target rank for accumulations
+      double cost;
+      size_t nDirectUses;		// uses as operand or diagram result
+      std::vector<size_t> consumerList;	// indices into the diagram list,
+					// sharing the cost
+	// cost saved by the re-use of this step
+      double getSavings() const {
+	return consumerList.empty() ? 0. : cost*(consumerList.size() - 1);
+      }
+    };
+
+    struct diagramCost_t {
+      std::vector<uint> resultIdList;
+      size_t nSteps;			// steps consumed by the diagram,
+					// shared or not
+      double standaloneCost, amortisedCost;
+    };
+
+  private:
+    std::vector<stepCost_t> stepList;
+    std::vector<diagramCost_t> diagramList;
+    double totalCost;
+
+  public:
+    CostReport(const ContractionOptimizer& cOp);
+
+    const std::vector<stepCost_t>& getStepList() const { return stepList; }
+    const std::vector<diagramCost_t>& getDiagramList() const { return diagramList; }
+      // cost of the whole plan, equal to the sum of amortised diagram costs
+    double getTotalCost() const { return totalCost; }
+
+      // one line per step, or per diagram, with a header line
+    void writeStepCSV(std::ostream& out) const;
+    void writeDiagramCSV(std::ostream& out) const;
+      // both tables as one JSON object
+    void writeJSON(std::ostream& out) const;
+};
+
+
+
+
+// ***************************************************************
+#endif
@@ -14,24 +14,23 @@ using namespace std;
    */
 
 
-  Diagram::Diagram(const Graph& _graph,
-      		   const std::vector<uint>& _tensIdList) :
-    	graph(_graph), tensIdList(_tensIdList) {
+  Diagram::Diagram(Graph _graph,
+      		   std::vector<uint> _tensIdList) :
+    	graph(std::move(_graph)), tensIdList(std::move(_tensIdList)),
+	correlatorId(noCorrelator), weight(1.) {
 
     _sortTensorList();
   }
 
-  Diagram::Diagram(const Graph& _graph,
-      		   const std::vector<uint>& _tensIdList,
-		   const std::vector<uint>& _resultIdList) :
-    	graph(_graph), tensIdList(_tensIdList), resultIdList(_resultIdList) {
+  Diagram::Diagram(Graph _graph,
+      		   std::vector<uint> _tensIdList,
+		   std::vector<uint> _resultIdList) :
+    	graph(std::move(_graph)), tensIdList(std::move(_tensIdList)),
+	resultIdList(std::move(_resultIdList)), correlatorId(noCorrelator), weight(1.) {
 	
     _sortTensorList();
   }
 
-  Diagram::Diagram(const Diagram& rhs) :
-    	graph(rhs.graph), tensIdList(rhs.tensIdList), resultIdList(rhs.resultIdList) {}
-
   void Diagram::_sortTensorList() {
     if (is_sorted(tensIdList.begin(), tensIdList.end())) return;
 
@@ -133,7 +132,8 @@ using namespace std;
 
   bool Diagram::getProfit(const uint graphStep,
 			  const iTup& globTensPair,
-		   	  ContractionCost& result) {
+		   	  ContractionCost& result,
+			  uint maxRank) {
       // check if the tensors in the proposed step occur in this diagram
     iTup tensPair;
     if (!_getLocalTensorIDs(globTensPair, tensPair)) return false;
@@ -145,7 +145,7 @@ using namespace std;
       return false;
 
      // it's a subexpression, go get profit from Graph
-    graph.getProfit(replStep, result);
+    graph.getProfit(replStep, result, maxRank);
     return true;
   }
 
@@ -159,16 +159,19 @@ using namespace std;
   }
 
 
-  std::pair<uint, std::vector<std::pair<uint, iTup>>> Diagram::singleTermOpt() const {
-    std::vector<uint> stepList;
-    uint cost;
-    std::tie(cost, stepList) = graph.singleTermOpt();
+  uint Diagram::singleTermOpt(std::vector<std::pair<uint, iTup>>& globStepList, uint maxRank) const {
+      // the local steps live in a stack arena, globStepList keeps its
+      // capacity between calls
+    std::byte scratchBuf[1024];
+    std::pmr::monotonic_buffer_resource scratch(scratchBuf, sizeof(scratchBuf));
+    std::pmr::vector<uint> stepList(&scratch);
+    uint cost = graph.singleTermOpt(stepList, maxRank);
 
-    std::vector<std::pair<uint, iTup>> globStepList;
+    globStepList.clear();
     for (auto mIt : stepList)
       globStepList.push_back(std::make_pair(mIt & 0xffffff00u, _getGlobalTensPair(mIt)));
 
-    return std::make_pair(cost, globStepList);
+    return cost;
   }
 
 
@@ -186,6 +189,9 @@ using namespace std;
       // add new tensor ID either to result list or tensIdList
     if (subcDone)
       resultIdList.push_back(newGlobId);
-    else
+    else {
       tensIdList.push_back(newGlobId);
+	// re-using an existing intermediary may break the ordering
+      _sortTensorList();
+    }
   }
@@ -16,27 +16,45 @@ class Diagram {
     Graph graph;
     std::vector<uint> tensIdList;
     std::vector<uint> resultIdList;
+      // correlator the diagram contributes to, with its weight
+    uint correlatorId;
+    double weight;
 
 
   public:
-    Diagram(const Graph& _graph, const std::vector<uint>& _tensIdList);
-    Diagram(const Graph& _graph, const std::vector<uint>& _tensIdList, const std::vector<uint>& _resultIdList);
-    Diagram(const Diagram& rhs);
+    static constexpr uint noCorrelator = ~0u;
+
+      // arguments are taken by value, so that callers can move large
+      // inputs in without a copy
+    Diagram(Graph _graph, std::vector<uint> _tensIdList);
+    Diagram(Graph _graph, std::vector<uint> _tensIdList, std::vector<uint> _resultIdList);
 
       // ContractionOptimizer::tune relies on this returning a reference
       // to find the maximum tensor ID
     const std::vector<uint>& getRemainingTensors() const { return tensIdList; }
-    std::vector<uint> getResultIdList() const { return resultIdList; }
-    Graph getGraph() const { return graph; }
+    const std::vector<uint>& getResultIdList() const { return resultIdList; }
+    const Graph& getGraph() const { return graph; }
     bool isDone() const;
 
-    std::pair<uint, std::vector<std::pair<uint, iTup>>> singleTermOpt() const;
+      // diagrams with the same correlator ID are summed with their weights
+      // by ContractionOptimizer::tune, see README
+    void setCorrelator(uint _correlatorId, double _weight = 1.) {
+      correlatorId = _correlatorId;
+      weight = _weight;
+    }
+    uint getCorrelatorId() const { return correlatorId; }
+    double getWeight() const { return weight; }
+
+      // fills stepList with the locally optimal steps in global tensor IDs
+      // and returns their cost order, see Graph::singleTermOpt
+    uint singleTermOpt(std::vector<std::pair<uint, iTup>>& stepList, uint maxRank = 0) const;
     bool replaceSubexpression(uint graphStep,
       			      const std::pair<uint, uint>& globTensPair,
 			      uint newGlobTensID);
     bool getProfit(const uint graphStep,
 		   const iTup& globTensPair,
-		   ContractionCost& result);
+		   ContractionCost& result,
+		   uint maxRank = 0);
 
     bool operator==(const Diagram& rhs) const {
       return ((graph == rhs.graph) && (tensIdList == rhs.tensIdList));
@@ -0,0 +1,158 @@
+#include "diagram_builder.h"
+
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <thread>
+
+
+using namespace std;
+
+
+  /*
+   *
+   * 	DiagramBuilder implementation
+   *
+   */
+
+
+  void DiagramBuilder::reserve(size_t nDiag, size_t nContr, size_t nTens) {
+    contrOffsets.reserve(nDiag + 1);
+    tensOffsets.reserve(nDiag + 1);
+    contrList.reserve(nContr);
+    tensIdList.reserve(nTens);
+  }
+
+  void DiagramBuilder::addDiagram(const contraction_t* contractions, size_t nContr,
+				  const uint* tensIds, size_t nTens) {
+    contrList.insert(contrList.end(), contractions, contractions + nContr);
+    contrOffsets.push_back(contrList.size());
+    tensIdList.insert(tensIdList.end(), tensIds, tensIds + nTens);
+    tensOffsets.push_back(tensIdList.size());
+  }
+
+  void DiagramBuilder::clear() {
+    contrList.clear();
+    tensIdList.clear();
+    contrOffsets.assign(1, 0);
+    tensOffsets.assign(1, 0);
+  }
+
+
+  Diagram DiagramBuilder::buildDiagram(const contraction_t* contractions, size_t nContr,
+				       const uint* tensIds, size_t nTens) {
+    const uint maxTensors = 16, maxSlots = 32;
+    if (nTens > maxTensors)
+      throw(std::string("A diagram can have at most 16 tensors."));
+
+      // indices taken by internal loops, one bit per index slot
+    uint loopMask[maxTensors] = {0};
+    for (size_t iC = 0; iC < nContr; ++iC) {
+      const contraction_t& aC = contractions[iC];
+      if (aC.tens1 >= nTens || aC.tens2 >= nTens)
+	throw(std::string("Contraction refers to a tensor outside the diagram."));
+      if (aC.ind1 >= maxSlots || aC.ind2 >= maxSlots)
+	throw(std::string("Tensor index out of range."));
+      if (aC.tens1 == aC.tens2)
+	loopMask[aC.tens1] |= (1u << aC.ind1) | (1u << aC.ind2);
+    }
+
+      // sort tensors by global ID: newId[old] is the position of local
+      // tensor old in the sorted list
+    uint order[maxTensors], newId[maxTensors];
+    for (uint iT = 0; iT < nTens; ++iT) order[iT] = iT;
+    std::stable_sort(order, order + nTens,
+		     [tensIds](uint i, uint j) { return tensIds[i] < tensIds[j]; });
+    for (uint iT = 0; iT < nTens; ++iT) newId[order[iT]] = iT;
+
+      // encode every contraction as one index pair of its tensor pair,
+      // the tensor with the smaller ID in the upper nibble as in
+      // Graph::canonicalize; codes of the same pair are merged below
+    uint codeList[maxTensors*7];
+    size_t nCodes = 0;
+    bool isConnected[maxTensors] = {false};
+    for (size_t iC = 0; iC < nContr; ++iC) {
+      const contraction_t& aC = contractions[iC];
+      if (aC.tens1 == aC.tens2) continue;
+
+	// index positions after removing internal loops
+      uint ind1 = aC.ind1 - __builtin_popcount(loopMask[aC.tens1] & ((1u << aC.ind1) - 1));
+      uint ind2 = aC.ind2 - __builtin_popcount(loopMask[aC.tens2] & ((1u << aC.ind2) - 1));
+      if (ind1 >= 7 || ind2 >= 7)
+	throw(std::string("Can't encode contractions for more than 7 indices per tensor."));
+
+      uint tens1 = newId[aC.tens1], tens2 = newId[aC.tens2];
+      if (tens1 > tens2) {
+	std::swap(tens1, tens2);
+	std::swap(ind1, ind2);
+      }
+      isConnected[tens1] = isConnected[tens2] = true;
+
+      if (nCodes == maxTensors*7)
+	throw(std::string("Too many contractions in diagram."));
+      codeList[nCodes++] = ((ind2 + 1) << (8 + 3*ind1)) | (tens1 << 4) | tens2;
+    }
+
+    for (uint iT = 0; iT < nTens; ++iT)
+      if (!isConnected[iT])
+	throw(std::string("Every tensor must be contracted with another one."));
+
+      // merge the codes of every tensor pair
+    std::sort(codeList, codeList + nCodes,
+	      [](uint a, uint b) { return (a & 0xffu) < (b & 0xffu); });
+    std::vector<unsigned int> icode;
+    for (size_t iC = 0; iC < nCodes; ++iC) {
+      if (!icode.empty() && (icode.back() & 0xffu) == (codeList[iC] & 0xffu))
+	icode.back() |= codeList[iC];
+      else
+	icode.push_back(codeList[iC]);
+    }
+    std::sort(icode.begin(), icode.end());
+
+    std::vector<uint> sortedIds(nTens);
+    for (uint iT = 0; iT < nTens; ++iT) sortedIds[iT] = tensIds[order[iT]];
+
+    return Diagram(Graph(std::move(icode)), std::move(sortedIds));
+  }
+
+
+  std::vector<Diagram> DiagramBuilder::build(uint nThreads) const {
+    size_t nDiag = size();
+    if (nThreads == 0) nThreads = max(1u, std::thread::hardware_concurrency());
+    nThreads = max<size_t>(1, min<size_t>(nThreads, nDiag));
+
+      // contiguous chunks of diagrams per thread, concatenated at the end
+    std::vector<std::vector<Diagram>> chunkList(nThreads);
+    std::vector<std::exception_ptr> errorList(nThreads);
+
+    auto buildChunk = [&] (uint iChunk) {
+      try {
+	size_t first = nDiag*iChunk/nThreads, last = nDiag*(iChunk + 1)/nThreads;
+	chunkList[iChunk].reserve(last - first);
+	for (size_t iD = first; iD < last; ++iD)
+	  chunkList[iChunk].push_back(buildDiagram(
+		contrList.data() + contrOffsets[iD], contrOffsets[iD+1] - contrOffsets[iD],
+		tensIdList.data() + tensOffsets[iD], tensOffsets[iD+1] - tensOffsets[iD]));
+      }
+      catch (...) {
+	errorList[iChunk] = std::current_exception();
+      }
+    };
+
+    std::vector<std::thread> threadList;
+    for (uint iT = 1; iT < nThreads; ++iT)
+      threadList.emplace_back(buildChunk, iT);
+    buildChunk(0);
+    for (auto& aThread : threadList)
+      aThread.join();
+
+    for (auto& anError : errorList)
+      if (anError) std::rethrow_exception(anError);
+
+    std::vector<Diagram> ret;
+    ret.reserve(nDiag);
+    for (auto& aChunk : chunkList)
+      for (auto& aDiag : aChunk)
+	ret.push_back(std::move(aDiag));
+    return ret;
+  }
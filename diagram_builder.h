@@ -0,0 +1,62 @@
+#ifndef DIAGRAM_BUILDER_H
+#define DIAGRAM_BUILDER_H
+
+#include <vector>
+
+#include "diagram.h"
+
+
+
+  // Builds large numbers of diagrams from flat arrays instead of going
+  // through GraphFactory and std::map/std::set. A diagram is given by its
+  // contractions (tens1, tens2, ind1, ind2) between local tensors
+  // 0, ..., nTens-1, and by the global IDs of these tensors, as would be
+  // passed to GraphFactory::addContraction and the Diagram constructor.
+  //
+  // Internal loops (tens1 == tens2) are removed, the indices of the affected
+  // tensors renumbered, the tensors sorted by global ID and the graph
+  // encoded directly, all in fixed-size arrays on the stack. The result is
+  // the same as
+  //	GraphFactory fac;
+  //	for (auto c : contractions) fac.addContraction(c.tens1, c.tens2, c.ind1, c.ind2);
+  //	Diagram(fac.getGraph(), tensIdList);
+class DiagramBuilder {
+
+  public:
+    struct contraction_t {
+      uint tens1, tens2, ind1, ind2;
+    };
+
+  private:
+      // all diagrams in CSR form: the contractions of diagram i are
+      // contrList[contrOffsets[i]] to contrList[contrOffsets[i+1]-1], its
+      // tensor IDs likewise in tensIdList
+    std::vector<contraction_t> contrList;
+    std::vector<size_t> contrOffsets;
+    std::vector<uint> tensIdList;
+    std::vector<size_t> tensOffsets;
+
+  public:
+    DiagramBuilder() : contrOffsets(1, 0), tensOffsets(1, 0) {}
+
+    void reserve(size_t nDiag, size_t nContr, size_t nTens);
+    void addDiagram(const contraction_t* contractions, size_t nContr,
+		    const uint* tensIds, size_t nTens);
+
+    size_t size() const { return contrOffsets.size() - 1; }
+    void clear();
+
+      // builds all diagrams added so far, in order, using nThreads threads
+      // (0: all cores)
+    std::vector<Diagram> build(uint nThreads = 1) const;
+
+      // builds a single diagram straight from its arrays
+    static Diagram buildDiagram(const contraction_t* contractions, size_t nContr,
+				const uint* tensIds, size_t nTens);
+};
+
+
+
+
+// ***************************************************************
+#endif
@@ -0,0 +1,196 @@
+#include "diagram_store.h"
+
+#include <algorithm>
+#include <string>
+
+
+using namespace std;
+
+
+  /*
+   *
+   * 	DiagramStore implementation
+   *
+   */
+
+
+  DiagramStore::DiagramStore(const std::vector<Diagram>& diagList) {
+    reserve(diagList.size());
+    for (const auto& aDiag : diagList)
+      push_back(aDiag);
+  }
+
+  void DiagramStore::reserve(size_t nDiag) {
+    graphList.reserve(nDiag);
+    tensIdSlab.reserve(nDiag*maxTensors);
+    nTensList.reserve(nDiag);
+    correlatorList.reserve(nDiag);
+    weightList.reserve(nDiag);
+  }
+
+  void DiagramStore::push_back(const Diagram& aDiag) {
+    const auto& tensIdList = aDiag.getRemainingTensors();
+    if (tensIdList.size() > maxTensors)
+      throw(std::string("Diagram exceeds maximal number of tensors."));
+
+    size_t iDiag = graphList.size();
+    graphList.push_back(aDiag.getGraph());
+    nTensList.push_back(tensIdList.size());
+    tensIdSlab.resize(tensIdSlab.size() + maxTensors, 0);
+    std::copy(tensIdList.begin(), tensIdList.end(), tensIdSlab.begin() + iDiag*maxTensors);
+    correlatorList.push_back(aDiag.getCorrelatorId());
+    weightList.push_back(aDiag.getWeight());
+
+    for (auto rId : aDiag.getResultIdList()) {
+      resultIdSlab.push_back(rId);
+      resultOwnerSlab.push_back(iDiag);
+    }
+  }
+
+  Diagram DiagramStore::getDiagram(size_t iDiag) const {
+    std::vector<uint> resultIdList;
+    for (size_t iR = 0; iR < resultOwnerSlab.size(); ++iR)
+      if (resultOwnerSlab[iR] == iDiag)
+	resultIdList.push_back(resultIdSlab[iR]);
+
+    auto tBegin = tensIdSlab.begin() + iDiag*maxTensors;
+    Diagram ret(graphList[iDiag],
+		std::vector<uint>(tBegin, tBegin + nTensList[iDiag]),
+		resultIdList);
+    ret.setCorrelator(correlatorList[iDiag], weightList[iDiag]);
+    return ret;
+  }
+
+  std::vector<Diagram> DiagramStore::getDiagramList() const {
+      // bucket the result slab by diagram in a single pass
+    std::vector<std::vector<uint>> resultIdLists(size());
+    for (size_t iR = 0; iR < resultOwnerSlab.size(); ++iR)
+      resultIdLists[resultOwnerSlab[iR]].push_back(resultIdSlab[iR]);
+
+    std::vector<Diagram> retList;
+    retList.reserve(size());
+    for (size_t iDiag = 0; iDiag < size(); ++iDiag) {
+      auto tBegin = tensIdSlab.begin() + iDiag*maxTensors;
+      retList.push_back(Diagram(graphList[iDiag],
+			std::vector<uint>(tBegin, tBegin + nTensList[iDiag]),
+			resultIdLists[iDiag]));
+      retList.back().setCorrelator(correlatorList[iDiag], weightList[iDiag]);
+    }
+
+    return retList;
+  }
+
+
+
+  /*
+   *
+   * 	DiagramStore::DiagramRef implementation
+   *
+   * 	mirrors the corresponding Diagram members, operating on the slot of
+   * 	this diagram in the tensor ID slab instead of a std::vector
+   *
+   */
+
+
+  DiagramStore::TensIdRange DiagramStore::DiagramRef::getRemainingTensors() const {
+    const uint* tIds = _tensIds();
+    return TensIdRange(tIds, tIds + store->nTensList[iDiag]);
+  }
+
+    // this implementation assumes that tensor IDs are sorted in the slot
+  bool DiagramStore::DiagramRef::_getLocalTensorIDs(const std::pair<uint, uint>& globTensPair, iTup& res) const {
+    const uint* tIds = _tensIds();
+    const uint* tEnd = tIds + store->nTensList[iDiag];
+
+    auto tIt1 = std::lower_bound(tIds, tEnd, globTensPair.first);
+    if (tIt1 == tEnd || *tIt1 != globTensPair.first) return false;
+    auto tIt2 = std::lower_bound(tIds, tEnd, globTensPair.second);
+    if (tIt2 == tEnd || *tIt2 != globTensPair.second) return false;
+
+    res = pair(tIt1 - tIds, tIt2 - tIds);
+    return true;
+  }
+
+  bool DiagramStore::DiagramRef::replaceSubexpression(const uint graphStep,
+						       const std::pair<uint, uint>& globTensPair,
+						       const uint newGlobTensID) {
+    iTup tensPair;
+    if (!_getLocalTensorIDs(globTensPair, tensPair)) return false;
+
+    Graph& graph = store->graphList[iDiag];
+    uint replStep = graph.isSubexpression(graphStep, tensPair);
+
+    if (replStep == 0)
+      return false;
+
+    bool subcDone = graph.replaceSubexpression(replStep);
+    _reorgTensIdList(tensPair, newGlobTensID, subcDone);
+    return true;
+  }
+
+  bool DiagramStore::DiagramRef::getProfit(const uint graphStep,
+					    const iTup& globTensPair,
+					    ContractionCost& result,
+					    uint maxRank) {
+    iTup tensPair;
+    if (!_getLocalTensorIDs(globTensPair, tensPair)) return false;
+
+    const Graph& graph = store->graphList[iDiag];
+    uint replStep = graph.isSubexpression(graphStep, tensPair);
+
+    if (replStep == 0)
+      return false;
+
+    graph.getProfit(replStep, result, maxRank);
+    return true;
+  }
+
+  uint DiagramStore::DiagramRef::singleTermOpt(std::vector<std::pair<uint, iTup>>& globStepList,
+					      uint maxRank) const {
+    std::byte scratchBuf[1024];
+    std::pmr::monotonic_buffer_resource scratch(scratchBuf, sizeof(scratchBuf));
+    std::pmr::vector<uint> stepList(&scratch);
+    uint cost = getGraph().singleTermOpt(stepList, maxRank);
+
+    const uint* tIds = _tensIds();
+    globStepList.clear();
+    for (auto mIt : stepList)
+      globStepList.push_back(std::make_pair(mIt & 0xffffff00u,
+	    			pair(tIds[(mIt >> 4) & 0xf], tIds[mIt & 0xf])));
+
+    return cost;
+  }
+
+  void DiagramStore::DiagramRef::_reorgTensIdList(const iTup& tensPair, uint newGlobId, bool subcDone) {
+    uint* tIds = _tensIds();
+    unsigned char& nTens = store->nTensList[iDiag];
+
+      // close the two gaps left by the contracted tensors in one pass
+    uint nKept = 0;
+    for (uint iT = 0; iT < nTens; ++iT)
+      if (iT != tensPair.first && iT != tensPair.second)
+	tIds[nKept++] = tIds[iT];
+
+      // add new tensor ID either to the result slab or the tensor slot
+    if (subcDone) {
+      store->resultIdSlab.push_back(newGlobId);
+      store->resultOwnerSlab.push_back(iDiag);
+      nTens = nKept;
+    }
+    else {
+      tIds[nKept] = newGlobId;
+      nTens = nKept + 1;
+
+	// re-using an existing intermediary may break the ordering: move the
+	// new tensor to its place and relabel the graph accordingly
+      uint newPos = std::upper_bound(tIds, tIds + nKept, newGlobId) - tIds;
+      if (newPos != nKept) {
+	std::rotate(tIds + newPos, tIds + nKept, tIds + nKept + 1);
+	  // indMap[oldIndex] = newIndex
+	std::vector<uint> indMap(nTens);
+	for (uint iT = 0; iT < nTens; ++iT)
+	  indMap[iT] = (iT < newPos) ? iT : (iT == nKept) ? newPos : iT + 1;
+	store->graphList[iDiag].relabelTensors(indMap);
+      }
+    }
+  }
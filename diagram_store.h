@@ -0,0 +1,89 @@
+#ifndef DIAGRAM_STORE_H
+#define DIAGRAM_STORE_H
+
+#include <vector>
+
+#include "diagram.h"
+
+
+
+  // Structure-of-arrays storage for a large number of diagrams. Since a
+  // graph can hold at most 16 tensors, every diagram gets a fixed-stride
+  // slot of 16 tensor IDs in one contiguous slab (64 bytes, i.e. one cache
+  // line per diagram), so that scanning many diagrams is sequential and
+  // replacing a subexpression never touches the allocator. Result IDs are
+  // appended to a separate slab together with the index of the diagram
+  // that produced them.
+class DiagramStore {
+
+  public:
+    static const unsigned int maxTensors = 16;
+
+      // iterator range over the remaining tensor IDs of one diagram
+    class TensIdRange {
+      private:
+	const uint *first, *last;
+      public:
+	TensIdRange(const uint* _first, const uint* _last) : first(_first), last(_last) {}
+	const uint* begin() const { return first; }
+	const uint* end() const { return last; }
+	size_t size() const { return last - first; }
+    };
+
+      // lightweight handle providing the Diagram interface used by
+      // ContractionOptimizer::tune on a diagram inside the store
+    class DiagramRef {
+      private:
+	DiagramStore* store;
+	size_t iDiag;
+
+      public:
+	DiagramRef(DiagramStore* _store, size_t _iDiag) : store(_store), iDiag(_iDiag) {}
+
+	TensIdRange getRemainingTensors() const;
+	const Graph& getGraph() const { return store->graphList[iDiag]; }
+	bool isDone() const { return store->nTensList[iDiag] == 0; }
+
+	uint singleTermOpt(std::vector<std::pair<uint, iTup>>& stepList, uint maxRank = 0) const;
+	bool replaceSubexpression(uint graphStep,
+				  const std::pair<uint, uint>& globTensPair,
+				  uint newGlobTensID);
+	bool getProfit(const uint graphStep,
+		       const iTup& globTensPair,
+		       ContractionCost& result,
+		       uint maxRank = 0);
+
+      private:
+	uint* _tensIds() const { return &store->tensIdSlab[iDiag*maxTensors]; }
+	void _reorgTensIdList(const iTup& tensPair, uint newGlobId, bool subcDone);
+	inline bool _getLocalTensorIDs(const std::pair<uint, uint>& globTensPair, iTup& res) const;
+    };
+
+  private:
+    std::vector<Graph> graphList;
+    std::vector<uint> tensIdSlab;
+    std::vector<unsigned char> nTensList;
+    std::vector<uint> resultIdSlab;
+    std::vector<uint> resultOwnerSlab;
+    std::vector<uint> correlatorList;
+    std::vector<double> weightList;
+
+  public:
+    DiagramStore() {}
+    DiagramStore(const std::vector<Diagram>& diagList);
+
+    void reserve(size_t nDiag);
+    void push_back(const Diagram& aDiag);
+
+    size_t size() const { return graphList.size(); }
+    DiagramRef operator[](size_t iDiag) { return DiagramRef(this, iDiag); }
+
+    Diagram getDiagram(size_t iDiag) const;
+    std::vector<Diagram> getDiagramList() const;
+};
+
+
+
+
+// ***************************************************************
+#endif  
@@ -1,10 +1,17 @@
 #include "graph.h"
 #include "diagram.h"
 #include "contraction_optimizer.h"
+#include "diagram_builder.h"
+#include "optimizer_service.h"
 
 #include <iostream>
 #include <fstream>
 #include <chrono>
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <unistd.h>
 
   template <typename T>
     std::ostream& operator<<(std::ostream& output, std::vector<T> const& values)
@@ -18,6 +25,108 @@
       return output;
     }
 
+    // builds nDiag random ring diagrams, a third of them with an internal
+    // loop, through GraphFactory and through DiagramBuilder, and returns the
+    // number of diagrams on which both differ
+  size_t checkDiagramBuilder(size_t nDiag) {
+    std::mt19937 rng(11);
+    DiagramBuilder builder;
+    std::vector<std::vector<DiagramBuilder::contraction_t>> contrLists;
+    std::vector<std::vector<uint>> tensIdLists;
+
+    for (size_t iD = 0; iD < nDiag; ++iD) {
+      uint nTens = 2 + rng() % 5;
+      bool hasLoop = (rng() % 3 == 0);
+
+	// tensor t passes from index in(t) to index out(t) of tensor t+1,
+	// the loop on tensor 0 makes the builder renumber its indices
+      std::vector<DiagramBuilder::contraction_t> contrList;
+      if (hasLoop) contrList.push_back({0, 0, 0, 2});
+      for (uint t = 0; t < nTens; ++t) {
+	uint u = (t + 1) % nTens;
+	uint indOut = (t == 0 && hasLoop) ? 3 : 1, indIn = (u == 0 && hasLoop) ? 1 : 0;
+	if (rng() % 2)
+	  contrList.push_back({t, u, indOut, indIn});
+	else
+	  contrList.push_back({u, t, indIn, indOut});
+      }
+
+      std::vector<uint> tensIdList;
+      while (tensIdList.size() < nTens) {
+	uint tensId = rng() % 50;
+	if (std::find(tensIdList.begin(), tensIdList.end(), tensId) == tensIdList.end())
+	  tensIdList.push_back(tensId);
+      }
+
+      builder.addDiagram(contrList.data(), contrList.size(), tensIdList.data(), tensIdList.size());
+      contrLists.push_back(std::move(contrList));
+      tensIdLists.push_back(std::move(tensIdList));
+    }
+
+    auto diagList = builder.build();
+    size_t nMismatch = 0;
+    for (size_t iD = 0; iD < nDiag; ++iD) {
+      GraphFactory fac;
+      for (const auto& aC : contrLists[iD])
+	fac.addContraction(aC.tens1, aC.tens2, aC.ind1, aC.ind2);
+      if (!(Diagram(fac.getGraph(), tensIdLists[iD]) == diagList[iD])) nMismatch++;
+    }
+    return nMismatch;
+  }
+
+    // tunes diagList with a dilution range of 64 through an OptimizerService
+    // on a socket of its own and sends it malformed diagrams; returns
+    // whether the service reproduced the plan of cOp, refused the malformed
+    // diagrams and served on
+  bool checkOptimizerService(const std::vector<Diagram>& diagList, const ContractionOptimizer& cOp) {
+    std::string socketPath = "/tmp/contraction_driver_" + std::to_string(getpid()) + ".sock";
+    OptimizerService service(socketPath);
+    std::thread serviceThread(&OptimizerService::run, &service);
+
+    ServiceRequest aRequest;
+    aRequest.nDil = 64;
+    aRequest.diagList = diagList;
+      // a graph without contractions, and a weight that is not a number
+    std::vector<ServiceRequest> badRequestList(2, aRequest);
+    badRequestList[0].diagList = {Diagram(Graph(std::vector<unsigned int>{0x01u}), {0, 1})};
+    badRequestList[1].diagList.back().setCorrelator(0, std::nan(""));
+
+    const auto& stepList = cOp.getCompStepList();
+    auto isSamePlan = [&stepList](const ServiceReply& aReply) {
+	return aReply.compStepList.size() == stepList.size()
+	  && std::equal(stepList.begin(), stepList.end(), aReply.compStepList.begin());
+      };
+
+    bool isOk = true;
+    size_t nRefused = 0;
+    try {
+      ServiceReply aReply = OptimizerService::submit(socketPath, aRequest);
+      isOk = (isSamePlan(aReply)
+	      && aReply.CSECost.getCostArray() == cOp.getCSECost().getCostArray());
+      for (size_t iD = 0; iD < diagList.size(); ++iD)
+	isOk = isOk && aReply.resultIdList[iD] == cOp.getDiagramList()[iD].getResultIdList();
+
+      for (const auto& badRequest : badRequestList) {
+	try {
+	  OptimizerService::submit(socketPath, badRequest);
+	}
+	catch (const std::string& err) {
+	  nRefused++;
+	}
+      }
+      isOk = isOk && nRefused == badRequestList.size()
+	&& isSamePlan(OptimizerService::submit(socketPath, aRequest));
+    }
+    catch (const std::string& err) {
+      std::cout << err << std::endl;
+      isOk = false;
+    }
+
+    service.stop();
+    serviceThread.join();
+    return isOk;
+  }
+
 int main() {
   ContractionCost::setDilutionRange(64);
 
@@ -49,6 +158,11 @@ int main() {
 
   std::cout<<"Expected:"<<std::endl
     << "cost w/o CSE = [0, 2, 0, 4, 0, ]"<<std::endl
-    << "cost w   CSE = [0, 2, 0, 3, 0, ]"<<std::endl;
+    << "cost w   CSE = [0, 2, 0, 3, 0, ]"<<std::endl<<std::endl;
+
+  std::cout << "DiagramBuilder vs GraphFactory, 200000 diagrams: "
+    << checkDiagramBuilder(200000) << " mismatches (expected 0)" << std::endl;
+  std::cout << "OptimizerService round trip and malformed requests: "
+    << (checkOptimizerService(diagList, cOp) ? "ok" : "FAILED") << std::endl;
 
 }
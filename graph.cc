@@ -1,5 +1,7 @@
 #include <algorithm>
 #include <iostream>
+#include <mutex>
+#include <string>
 #include "graph.h"
 
 
@@ -21,9 +23,18 @@ using namespace std;
    *
    */
 
+  ContractionCost::ContractionCost(const std::vector<unsigned int>& _store,
+				   unsigned int _maxIntermediateRank) :
+	store{}, maxIntermediateRank(_maxIntermediateRank) {
+    if (_store.size() > maxOrder)
+      throw(std::string("Cost array with more than ") + std::to_string(maxOrder) + " orders.");
+    std::copy(_store.begin(), _store.end(), store.begin());
+  }
+
   ContractionCost& ContractionCost::operator+=(const ContractionCost& rhs) {
     for (unsigned int iC=0; iC < store.size(); ++iC)
       store[iC] += rhs.store[iC];
+    updateMaxIntermediateRank(rhs.maxIntermediateRank);
 
     return *this;
   }
@@ -77,12 +88,24 @@ using namespace std;
     encode(contrList);
   }
 
+  Graph Graph::fromContractionList(const pmrContrType& contrList) {
+    Graph ret(std::vector<unsigned int>{});
+    ret.encode(contrList);
+    return ret;
+  }
+
   map<iTup, std::set<iTup>> Graph::getContractionList() const {
     map<iTup, std::set<iTup>> ret;
     decode(ret);
     return ret;
   }
 
+  pmrContrType Graph::getContractionList(std::pmr::memory_resource* mr) const {
+    pmrContrType ret(mr);
+    decode(ret);
+    return ret;
+  }
+
 
     // a graph is encoded in a set of unsigned int, each unsigned int
     // corresponds to one (tens1, tens2) : { <contraction pairs> }
@@ -133,10 +156,11 @@ using namespace std;
     std::sort(icode.begin(), icode.end());
   }
 
-  void Graph::encode(const std::map<iTup, std::set<iTup>>& contrList) {
+  template <class ContrList>
+  void Graph::encode(const ContrList& contrList) {
     icode.clear();
 
-    for (auto mIt : contrList) {
+    for (const auto& mIt : contrList) {
       //if (mIt.second.size() > 7)
 	//throw(std::runtime_error("Can't encode contractions for more than 7 quark fields"));
 
@@ -178,16 +202,39 @@ using namespace std;
     return retSet;
   }
 
-  void Graph::decode(map<iTup, std::set<iTup>>& contrList) const {
+  std::pmr::set<iTup> Graph::decodeElement(unsigned int aC, std::pmr::memory_resource* mr) {
+    std::pmr::set<iTup> retSet(mr);
+
+    for (unsigned int cInd1 = 0; cInd1 < 7; ++cInd1) {
+      unsigned int cInd2 = (aC >> (8+3*cInd1)) & 0x7;
+      if (cInd2 != 0)
+	retSet.insert(std::make_pair(cInd1, cInd2-1));
+    }
+
+    return retSet;
+  }
+
+  unsigned int Graph::getNumContractions(unsigned int aC) {
+    unsigned int nContr = 0;
+    for (unsigned int cInd1 = 0; cInd1 < 7; ++cInd1)
+      if ((aC >> (8+3*cInd1)) & 0x7) ++nContr;
+    return nContr;
+  }
+
+  template <class ContrList>
+  void Graph::decode(ContrList& contrList) const {
     contrList.clear();
 
     for (auto mIt : icode) {
       unsigned int tens2 = mIt & 0xf;
       unsigned int tens1 = (mIt >> 4) & 0xf;
 
-      std::set<iTup> contrIndSet = decodeElement(mIt);
-
-      contrList.emplace(std::make_pair(tens1, tens2), contrIndSet);
+      auto cIt = contrList.try_emplace(std::make_pair(tens1, tens2)).first;
+      for (unsigned int cInd1 = 0; cInd1 < 7; ++cInd1) {
+	unsigned int cInd2 = (mIt >> (8+3*cInd1)) & 0x7;
+	if (cInd2 != 0)
+	  cIt->second.insert(std::make_pair(cInd1, cInd2-1));
+      }
     }
   }
 
@@ -207,18 +254,34 @@ using namespace std;
   }
 
 
-  std::pair<unsigned int, std::vector<unsigned int>> Graph::singleTermOpt() const {
+  unsigned int Graph::singleTermOpt(std::pmr::vector<unsigned int>& retList,
+				    unsigned int maxRank) const {
     unsigned int bestReduction = 0, bestCost = 0;
-    std::vector<uint> retList;
+    retList.clear();
+    retList.reserve(icode.size());
+
+      // with a rank limit in place, only consider the steps within the
+      // limit, or the ones with the smallest intermediary if there are none
+    unsigned int rankLimit = maxRank;
+    if (maxRank > 0) {
+      unsigned int minRank = ~0u;
+      for (auto mIt : icode)
+	minRank = std::min(minRank, getResultRank(mIt));
+      rankLimit = std::max(maxRank, minRank);
+    }
+
+      // tensor sizes on the stack, this runs for every step of every diagram
+    unsigned int tensSizeList[16];
+    _getAllNumInds(tensSizeList);
 
     for (auto mIt : icode) {
       size_t tensId1 = (mIt >> 4) & 0xfu, tensId2 = mIt & 0xfu;
+      if (maxRank > 0 && getResultRank(mIt) > rankLimit) continue;
 	// find the reduction that removes as many indices as possible
-      unsigned int reduction = decodeElement(mIt).size();
+      unsigned int reduction = getNumContractions(mIt);
 
       if (reduction >= bestReduction) {
 	  // break ties using cost
-	std::vector<unsigned int> tensSizeList = getAllNumInds();
 	unsigned int cost = tensSizeList[tensId1] + tensSizeList[tensId2] - reduction;
 
 	if (reduction == bestReduction && cost < bestCost) {
@@ -238,35 +301,46 @@ using namespace std;
       }
     }
 
-    return std::make_pair(bestCost, retList);
+    return bestCost;
   }
 
 
 
 
   std::vector<unsigned int> Graph::getAllNumInds() const {
-    std::map< unsigned int,  unsigned int> tensSizeDict;
+    unsigned int nIndsList[16];
+    unsigned int nTens = _getAllNumInds(nIndsList);
+    return std::vector<unsigned int>(nIndsList, nIndsList + nTens);
+  }
+
+    // writes the number of indices of all tensors occurring in the graph,
+    // ordered by tensor ID, to nIndsList and returns the number of tensors
+  unsigned int Graph::_getAllNumInds(unsigned int* nIndsList) const {
+    unsigned int tensSizeDict[16] = {0};
+    bool tensFound[16] = {false};
 
     for (auto mIt : icode) {
       unsigned int tensId1 = (mIt >> 4) & 0xfu, tensId2 = mIt & 0xfu;
-      auto tIt1 = tensSizeDict.emplace(tensId1, 0).first;
-      auto tIt2 = tensSizeDict.emplace(tensId2, 0).first;
+      tensFound[tensId1] = tensFound[tensId2] = true;
       for ( unsigned int cInd1 = 0; cInd1 < 7; ++cInd1) {
 	 unsigned int cInd2 = (mIt >> (8+3*cInd1)) & 0x7;
 	if (cInd2 != 0) {
-	  if (cInd1 >= tIt1->second) tIt1->second = cInd1 + 1;
-	  if (cInd2 > tIt2->second) tIt2->second = cInd2;
+	  if (cInd1 >= tensSizeDict[tensId1]) tensSizeDict[tensId1] = cInd1 + 1;
+	  if (cInd2 > tensSizeDict[tensId2]) tensSizeDict[tensId2] = cInd2;
 	}
       }
     }
 
-    std::vector<unsigned int> retVec;
+    unsigned int nTens = 0;
+    for (unsigned int tId = 0; tId < 16; ++tId)
+      if (tensFound[tId]) nIndsList[nTens++] = tensSizeDict[tId];
 
-    for (auto tIt : tensSizeDict) {
-      retVec.push_back(tIt.second);
-    }
+    return nTens;
+  }
 
-    return retVec;
+  unsigned int Graph::getResultRank(unsigned int aStep) const {
+    unsigned int nContr = getNumContractions(aStep);
+    return getNumInds((aStep >> 4) & 0xfu) + getNumInds(aStep & 0xfu) - 2*nContr;
   }
 
   unsigned int Graph::getNumInds(unsigned int tensId) const {
@@ -294,42 +368,52 @@ using namespace std;
   }
 
 
-  bool Graph::replaceSubexpression(uint replStep) {
-      // try the cache
-    auto cIt = replCache.find(std::make_pair(*this, replStep));
-
-    if (cIt == replCache.end()) {
-	// now we actually have to do the replacement
-      replCacheMiss++;
-      doReplacement(replStep);
-      cIt = replCache.find(std::make_pair(*this, replStep));
+    // cache entries are never erased while the caches are in use, so
+    // references to them stay valid after the lock has been released
+  const std::pair<Graph, bool>& Graph::_getReplacement(uint replStep) const {
+    {
+      std::shared_lock<std::shared_mutex> lock(cacheMutex);
+      auto cIt = replCache.find(std::make_pair(this, replStep));
+      if (cIt != replCache.end()) {
+	replCacheHit++;
+	return cIt->second;
+      }
     }
-    else
-      replCacheHit++;
 
+      // now we actually have to do the replacement
+    replCacheMiss++;
+    return doReplacement(replStep);
+  }
 
+  bool Graph::replaceSubexpression(uint replStep) {
     bool subcDone;
-    std::tie(*this, subcDone) = cIt->second;
+    std::tie(*this, subcDone) = _getReplacement(replStep);
     return subcDone;
   }
 
-  void Graph::doReplacement(uint replStep) const {
+  const std::pair<Graph, bool>& Graph::doReplacement(uint replStep) const {
     iTup tensPair((replStep >> 4) & 0xfu, replStep & 0xfu);
+    unsigned int nTens = getAllNumInds().size();
+
+      // all temporaries of the replacement live in a stack arena, only the
+      // resulting graph is allocated on the heap
+    std::byte scratchBuf[8192];
+    std::pmr::monotonic_buffer_resource scratch(scratchBuf, sizeof(scratchBuf));
 
       // function returning the new position of a tensor in tensIdList
       // given the old position: the contracted tensors are removed, and
       // the newly added result is appended at the end
-    auto getNewTensID = [this,&tensPair] (uint tId) {
+    auto getNewTensID = [nTens,&tensPair] (uint tId) {
       if (tId == tensPair.first || tId == tensPair.second)
-	return (unsigned int)getAllNumInds().size()-2;
+	return nTens-2;
       uint retId = tId;
       if (tId > tensPair.first) retId--;
       if (tId > tensPair.second) retId--;
       return retId;
     };
 
-    auto contrSet = decodeElement(replStep);
-    std::set<uint> idx_remove1, idx_remove2;
+    auto contrSet = decodeElement(replStep, &scratch);
+    std::pmr::set<uint> idx_remove1(&scratch), idx_remove2(&scratch);
     unsigned int nInds1 = getNumInds(tensPair.first);
 
     for (auto cIt : contrSet) {
@@ -363,15 +447,14 @@ using namespace std;
       else return true;
     };
 
-    auto contrList = getContractionList();
-    GraphFactory newGraphFac;
+    auto contrList = getContractionList(&scratch);
+    GraphFactory newGraphFac(&scratch);
       // flag to check if this is the last (sub)contraction in this graph
     bool subcDone = true;
 
-    for (auto mIt : contrList) {
-      iTup cTensPair;
-      set<iTup> cSet;
-      std::tie(cTensPair, cSet) = mIt;
+    for (const auto& mIt : contrList) {
+      const iTup& cTensPair = mIt.first;
+      const auto& cSet = mIt.second;
 
         // quick check if the tensors involved in mIt are touched by the
 	// proposed contraction:
@@ -412,62 +495,93 @@ using namespace std;
 
       // add newly found replacement to cache
     Graph newGraph = newGraphFac.getGraph();
-    replCache.emplace(std::make_pair(*this, replStep), std::make_pair(newGraph, subcDone));
+      // another thread may have added it meanwhile, that entry is the same
+    std::unique_lock<std::shared_mutex> lock(cacheMutex);
+    return replCache.emplace(std::make_pair(*this, replStep),
+			     std::make_pair(newGraph, subcDone)).first->second;
   }
 
 
-  void Graph::getProfit(const uint replStep, ContractionCost& result) const {
-      // try the cache
-    auto cIt = replCache.find(std::make_pair(*this, replStep));
-
-    if (cIt == replCache.end()) {
-	// now we actually have to do the replacement
-      replCacheMiss++;
-      doReplacement(replStep);
-      cIt = replCache.find(std::make_pair(*this, replStep));
-    }
-    else
-      replCacheHit++;
+  void Graph::getProfit(const uint replStep, ContractionCost& result,
+      		       unsigned int maxRank) const {
+    const Graph& newGraph = _getReplacement(replStep).first;
 
-    result += getRemainingCost();
-    result -= cIt->second.first.getRemainingCost();
+    result += getRemainingCost(maxRank);
+    result -= newGraph.getRemainingCost(maxRank);
   }
 
-  ContractionCost Graph::getRemainingCost() const {
+  ContractionCost Graph::getRemainingCost(unsigned int maxRank) const {
     ContractionCost retCost;
 
-    auto cacheIt = costCache.find(*this);
-    if (cacheIt != costCache.end()) {
-      costCacheHit++;
-      return cacheIt->second;
+    {
+      std::shared_lock<std::shared_mutex> lock(cacheMutex);
+      auto cacheIt = costCache.find(std::make_pair(this, maxRank));
+      if (cacheIt != costCache.end()) {
+	costCacheHit++;
+	return cacheIt->second;
+      }
     }
 
     costCacheMiss++;
 
     Graph tmpGraph(*this);
+    std::byte scratchBuf[1024];
+    std::pmr::monotonic_buffer_resource scratch(scratchBuf, sizeof(scratchBuf));
+    std::pmr::vector<uint> stepList(&scratch);
 
     while (tmpGraph.icode.size() > 0) {
-      std::vector<uint> stepList;
-      uint cost;
-
-      std::tie(cost, stepList) = tmpGraph.singleTermOpt();
+      uint cost = tmpGraph.singleTermOpt(stepList, maxRank);
 
+      retCost.updateMaxIntermediateRank(tmpGraph.getResultRank(stepList.front()));
       tmpGraph.replaceSubexpression(stepList.front());
       retCost += cost;
     }
 
-    costCache[*this] = retCost;
+    std::unique_lock<std::shared_mutex> lock(cacheMutex);
+    costCache.emplace(std::make_pair(*this, maxRank), retCost);
     return retCost;
   }
 
+    // pool backing both caches, must be constructed before them. It only
+    // allocates while cacheMutex is held exclusively, so it need not be
+    // synchronized itself
+  std::pmr::unsynchronized_pool_resource Graph::cachePool;
+  std::shared_mutex Graph::cacheMutex;
+  uint Graph::nCacheUsers = 0;
+
     // replacement cache
-  std::map<std::pair<Graph, unsigned int>, std::pair<Graph, bool>> Graph::replCache = std::map<std::pair<Graph, unsigned int>, std::pair<Graph, bool>>();
-  uint Graph::replCacheHit = 0;
-  uint Graph::replCacheMiss = 0;
-
-    // cost cache
-  std::map<Graph, ContractionCost> Graph::costCache = std::map<Graph, ContractionCost>();
-  uint Graph::costCacheHit = 0;
-  uint Graph::costCacheMiss = 0;
+  std::pmr::map<std::pair<Graph, unsigned int>, std::pair<Graph, bool>, GraphCacheKeyLess> Graph::replCache(&Graph::cachePool);
+  thread_local uint Graph::replCacheHit = 0;
+  thread_local uint Graph::replCacheMiss = 0;
+
+    // cost cache, keyed by graph and maximal intermediary rank
+  std::pmr::map<std::pair<Graph, unsigned int>, ContractionCost, GraphCacheKeyLess> Graph::costCache(&Graph::cachePool);
+  thread_local uint Graph::costCacheHit = 0;
+  thread_local uint Graph::costCacheMiss = 0;
+
+  void Graph::acquireCaches() {
+    std::unique_lock<std::shared_mutex> lock(cacheMutex);
+    ++nCacheUsers;
+  }
+
+  void Graph::releaseCaches() {
+    std::unique_lock<std::shared_mutex> lock(cacheMutex);
+    if (nCacheUsers == 0 || --nCacheUsers > 0) return;
+    replCache.clear();
+    costCache.clear();
+    cachePool.release();
+  }
+
+  size_t Graph::getCacheSize() {
+    std::shared_lock<std::shared_mutex> lock(cacheMutex);
+    return replCache.size() + costCache.size();
+  }
+
+  void Graph::clearCaches() {
+    std::unique_lock<std::shared_mutex> lock(cacheMutex);
+    replCache.clear();
+    costCache.clear();
+    cachePool.release();
+  }
 
 // ***************************************************************
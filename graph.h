@@ -1,29 +1,52 @@
 #ifndef GRAPH_H
 #define GRAPH_H
 
+#include <array>
 #include <map>
 #include <set>
 #include <vector>
+#include <memory_resource>
+#include <shared_mutex>
 
 
 typedef std::pair<uint, uint> iTup;
 typedef std::map<iTup, std::set<iTup>> contrType;
+  // same as contrType, allocating from a given memory resource
+typedef std::pmr::map<iTup, std::pmr::set<iTup>> pmrContrType;
+
+struct GraphCacheKeyLess;
 
 class ContractionCost {
 
+  public:
+      // highest cost order Ndil^maxOrder that is counted
+    static const unsigned int maxOrder = 5;
+
   private:
-    std::vector<unsigned int> store;
+      // fixed size, so that costs are copied and returned without
+      // touching the heap
+    std::array<unsigned int, maxOrder> store;
+      // rank of the largest intermediary formed, not part of the comparison
+    unsigned int maxIntermediateRank;
     static unsigned int nDil;
 
   public:
-    ContractionCost() : store(5,0) {}
+    ContractionCost() : store{}, maxIntermediateRank(0) {}
+      // throws if _store has more than maxOrder entries
+    ContractionCost(const std::vector<unsigned int>& _store, unsigned int _maxIntermediateRank);
 
     ContractionCost& operator+=(const ContractionCost& rhs);
     ContractionCost& operator-=(const ContractionCost& rhs);
     ContractionCost& operator+=(const unsigned int& rhs);
     bool operator<(const ContractionCost& rhs) const;
 
-    std::vector<unsigned int> getCostArray() const { return store; }
+    std::vector<unsigned int> getCostArray() const {
+      return std::vector<unsigned int>(store.begin(), store.end());
+    }
+    unsigned int getMaxIntermediateRank() const { return maxIntermediateRank; }
+    void updateMaxIntermediateRank(unsigned int rank) {
+      if (rank > maxIntermediateRank) maxIntermediateRank = rank;
+    }
 
     static void setDilutionRange(uint _nDil) { nDil = _nDil; }
     static unsigned int getDilutionRange() { return nDil; }
@@ -41,7 +64,10 @@ class Graph
 
   public:
     Graph(const std::map<iTup, std::set<iTup>>& contrList);
-    Graph(const std::vector<unsigned int>& _icode) : icode(_icode) {}
+    Graph(std::vector<unsigned int> _icode) : icode(std::move(_icode)) {}
+      // not a constructor, so that brace-initialised contraction lists stay
+      // unambiguous
+    static Graph fromContractionList(const pmrContrType& contrList);
 
     const std::vector<unsigned int>& __hash__() const { return icode; }
     bool operator==(const Graph& rhs) const { return icode == rhs.icode; }
@@ -49,53 +75,131 @@ class Graph
 
     unsigned int isSubexpression(const unsigned int aStep,
 				 const std::pair<uint, uint>& tensPair) const;
-    std::pair<unsigned int, std::vector<unsigned int>> singleTermOpt() const;
+      // fills stepList with the locally optimal steps and returns their
+      // cost order; stepList is the caller's buffer, usually backed by a
+      // stack arena, so that this does not allocate in steady state.
+      // maxRank > 0 excludes steps forming an intermediary of higher rank,
+      // unless there is no other choice, in which case the steps with the
+      // smallest intermediary are suggested
+    unsigned int singleTermOpt(std::pmr::vector<unsigned int>& stepList,
+			       unsigned int maxRank = 0) const;
 
     std::map<iTup, std::set<iTup>> getContractionList() const;
+    pmrContrType getContractionList(std::pmr::memory_resource* mr) const;
     unsigned int getNumInds(unsigned int tensId) const;
     std::vector<unsigned int> getAllNumInds() const;
+      // rank of the tensor formed by the contraction aStep
+    unsigned int getResultRank(unsigned int aStep) const;
 #ifdef SAFETY_FLAG
     std::set<unsigned int> getTensorIDSet() const;
 #endif
 
-    ContractionCost getRemainingCost() const;
-    void getProfit(const uint replStep, ContractionCost& result) const;
+    ContractionCost getRemainingCost(unsigned int maxRank = 0) const;
+    void getProfit(const uint replStep, ContractionCost& result,
+		   unsigned int maxRank = 0) const;
 
     bool replaceSubexpression(uint graphStep);
-    void doReplacement(uint replStep) const;
+      // computes the result of replaceSubexpression and adds it to the cache
+    const std::pair<Graph, bool>& doReplacement(uint replStep) const;
       // given a mapping oldTensId -> newTensId, relabel tensor IDs
     void relabelTensors(const std::vector<uint>& indMap);
 
     static std::set<iTup> decodeElement(unsigned int aC);
+    static std::pmr::set<iTup> decodeElement(unsigned int aC, std::pmr::memory_resource* mr);
+      // number of index pairs contracted in aC
+    static unsigned int getNumContractions(unsigned int aC);
+
+      // the caches live as long as there is at least one GraphCacheHandle;
+      // after the last one is gone their memory is released in bulk. Every
+      // ContractionOptimizer holds a handle, so code using Graph on its own
+      // (e.g. getRemainingCost) loses the entries cached by an optimizer once
+      // it is destroyed; hold a GraphCacheHandle to keep them. Without any
+      // handle the caches still fill, and are only emptied the next time
+      // the last handle goes away
+    static void acquireCaches();
+    static void releaseCaches();
+      // number of entries in both caches, and emptying them regardless of
+      // the handles; references to cached graphs become invalid, so no
+      // other thread may use a Graph meanwhile
+    static size_t getCacheSize();
+    static void clearCaches();
 
   private:
     unsigned int canonicalize(unsigned int aC) const;
     unsigned int reverse(unsigned int aC) const;
-    void encode(const std::map<iTup, std::set<iTup>>& contrList);
-    void decode(std::map<iTup, std::set<iTup>>& contrList) const;
-
-      // cache infrastructure
-    static std::map<std::pair<Graph, unsigned int>, std::pair<Graph, bool>> replCache;
-    static uint replCacheHit, replCacheMiss;
-    static std::map<Graph, ContractionCost> costCache;
-    static uint costCacheHit, costCacheMiss;
+    template <class ContrList>
+      void encode(const ContrList& contrList);
+    template <class ContrList>
+      void decode(ContrList& contrList) const;
+    unsigned int _getAllNumInds(unsigned int* nIndsList) const;
+
+    const std::pair<Graph, bool>& _getReplacement(uint replStep) const;
+
+      // cache infrastructure: the caches are shared between threads, and
+      // their map nodes are allocated from a pool. Lookups allocate
+      // nothing; the icode vectors of the graphs in keys and values are
+      // still allocated on the default heap at every insertion
+    static std::pmr::unsynchronized_pool_resource cachePool;
+    static std::shared_mutex cacheMutex;
+      // number of GraphCacheHandles, guarded by cacheMutex so that the
+      // caches cannot be cleared while a new handle is being acquired
+    static uint nCacheUsers;
+    static std::pmr::map<std::pair<Graph, unsigned int>, std::pair<Graph, bool>, GraphCacheKeyLess> replCache;
+    static thread_local uint replCacheHit, replCacheMiss;
+    static std::pmr::map<std::pair<Graph, unsigned int>, ContractionCost, GraphCacheKeyLess> costCache;
+    static thread_local uint costCacheHit, costCacheMiss;
+};
+
+
+  // orders cache keys (graph, parameter); lookups by (graph pointer,
+  // parameter) avoid copying the graph just to search for it
+struct GraphCacheKeyLess {
+  typedef void is_transparent;
+  typedef std::pair<Graph, unsigned int> key_t;
+  typedef std::pair<const Graph*, unsigned int> lookup_t;
+
+  static bool less(const Graph& g1, unsigned int p1, const Graph& g2, unsigned int p2) {
+    return (g1 < g2) || (g1 == g2 && p1 < p2);
+  }
+  bool operator()(const key_t& lhs, const key_t& rhs) const {
+    return less(lhs.first, lhs.second, rhs.first, rhs.second);
+  }
+  bool operator()(const key_t& lhs, const lookup_t& rhs) const {
+    return less(lhs.first, lhs.second, *rhs.first, rhs.second);
+  }
+  bool operator()(const lookup_t& lhs, const key_t& rhs) const {
+    return less(*lhs.first, lhs.second, rhs.first, rhs.second);
+  }
+};
+
+
+  // keeps the caches of Graph alive, see Graph::acquireCaches
+class GraphCacheHandle {
+  public:
+    GraphCacheHandle() { Graph::acquireCaches(); }
+    GraphCacheHandle(const GraphCacheHandle&) { Graph::acquireCaches(); }
+    GraphCacheHandle& operator=(const GraphCacheHandle&) { return *this; }
+    ~GraphCacheHandle() { Graph::releaseCaches(); }
 };
 
 
 class GraphFactory {
 
   private:
-    std::map<iTup, std::set<iTup>> contrList;
+    pmrContrType contrList;
 
   public:
+      // all temporaries of the factory are allocated from mr
+    GraphFactory(std::pmr::memory_resource* mr = std::pmr::get_default_resource()) :
+      contrList(mr) {}
 
     void addContraction(const iTup& tensPair, const std::set<iTup>& newC) {
-      auto mIt = contrList.emplace(tensPair, std::set<iTup>()).first;
+      auto mIt = contrList.try_emplace(tensPair).first;
       mIt->second.insert(newC.begin(), newC.end());
     }
 
     void addContraction(const iTup& tensPair, const iTup& newC) {
-      auto mIt = contrList.emplace(tensPair, std::set<iTup>()).first;
+      auto mIt = contrList.try_emplace(tensPair).first;
       mIt->second.insert(newC);
     }
 
@@ -113,7 +217,7 @@ class GraphFactory {
 
     Graph getGraph() {
       removeInternalLoops();
-      return Graph(contrList);
+      return Graph::fromContractionList(contrList);
     }
 
     void reset() {
@@ -123,7 +227,8 @@ class GraphFactory {
      // remove internal loops from graph and relabel remaining indices
      // accordingly.
     void removeInternalLoops() {
-      std::set<uint> unique_tensors;
+      std::pmr::memory_resource* mr = contrList.get_allocator().resource();
+      std::pmr::set<uint> unique_tensors(mr);
 
       for (auto aPair : contrList) {
 	unique_tensors.insert(aPair.first.first);
@@ -135,7 +240,7 @@ class GraphFactory {
 	  // if there is an internal loop on this index
 	if (intLoopIt != contrList.end()) {
 	    // collect indices to remove
-	  std::set<uint> idx_remove;
+	  std::pmr::set<uint> idx_remove(mr);
 	  for (auto cPair : intLoopIt->second) {
 	    idx_remove.insert(cPair.first);
 	    idx_remove.insert(cPair.second);
@@ -148,25 +253,25 @@ class GraphFactory {
 	  for (auto& aPair : contrList) {
 	     // if the internal loop tensor is the first one in tensPair
 	    if (aPair.first.first == iTens) {
-	      std::set<iTup> newContrSet;
+	      std::pmr::set<iTup> newContrSet(mr);
 	      for (auto& aContr : aPair.second) {
 		unsigned int nRem = 0;
 		for (auto aRemInd : idx_remove)
 		  if (aRemInd < aContr.first) ++nRem;
 		newContrSet.insert(std::make_pair(aContr.first-nRem, aContr.second));
 	      }
-	      aPair.second = newContrSet;
+	      aPair.second.swap(newContrSet);
 	    }
 	     // if the internal loop tensor is the second one in tensPair
 	    else if (aPair.first.second == iTens) {
-	      std::set<iTup> newContrSet;
+	      std::pmr::set<iTup> newContrSet(mr);
 	      for (auto& aContr : aPair.second) {
 		unsigned int nRem = 0;
 		for (auto aRemInd : idx_remove)
 		  if (aRemInd < aContr.second) ++nRem;
 		newContrSet.insert(std::make_pair(aContr.first, aContr.second-nRem));
 	      }
-	      aPair.second = newContrSet;
+	      aPair.second.swap(newContrSet);
 	    }
 	  }
 	}
@@ -0,0 +1,37 @@
+#include "optimizer_service.h"
+
+#include <iostream>
+#include <csignal>
+
+
+  static OptimizerService* theService = nullptr;
+
+  static void _handleSignal(int) {
+    if (theService) theService->stop();
+  }
+
+int main(int argc, char** argv) {
+  if (argc < 2 || argc > 3) {
+    std::cerr << "usage: " << argv[0] << " <socket path> [max. concurrent tunes]" << std::endl;
+    return 1;
+  }
+
+  try {
+    OptimizerService service(argv[1], argc > 2 ? std::stoul(argv[2]) : 0);
+    theService = &service;
+    std::signal(SIGINT, _handleSignal);
+    std::signal(SIGTERM, _handleSignal);
+
+    std::cout << "Listening on " << argv[1] << std::endl;
+    service.run();
+    theService = nullptr;
+  }
+  catch (const std::string& err) {
+    std::cerr << err << std::endl;
+    return 1;
+  }
+  catch (const std::exception& err) {
+    std::cerr << err.what() << std::endl;
+    return 1;
+  }
+}
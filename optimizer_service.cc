@@ -0,0 +1,511 @@
+#include "optimizer_service.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <thread>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+using namespace std;
+
+
+  /*
+   *
+   * 	message encoding
+   *
+   */
+
+
+  static const char requestMagic[4] = {'C','O','R','Q'};
+  static const char replyMagic[4] = {'C','O','R','P'};
+    // input tensor IDs must be below this, since intermediates are numbered
+    // on from the largest one; no request within maxMessageSize forms 2^31
+  static const uint maxInputTensId = 1u << 31;
+    // guards against allocating for a corrupt length prefix; a diagram
+    // takes some 100 bytes, so this leaves room for millions of them
+  static const uint64_t maxMessageSize = 1ul << 30;
+
+  template <class T>
+  static void _putValue(std::string& buf, const T& val) {
+    buf.append(reinterpret_cast<const char*>(&val), sizeof(T));
+  }
+
+  template <class T>
+  static void _putVector(std::string& buf, const std::vector<T>& vec) {
+    _putValue(buf, uint32_t(vec.size()));
+    buf.append(reinterpret_cast<const char*>(vec.data()), vec.size()*sizeof(T));
+  }
+
+  template <class T>
+  static void _getValue(const std::string& buf, size_t& pos, T& val) {
+    if (buf.size() - pos < sizeof(T))
+      throw(std::string("Truncated service message."));
+    memcpy(&val, buf.data() + pos, sizeof(T));
+    pos += sizeof(T);
+  }
+
+  template <class T>
+  static void _getVector(const std::string& buf, size_t& pos, std::vector<T>& vec) {
+    uint32_t size;
+    _getValue(buf, pos, size);
+    if ((buf.size() - pos) / sizeof(T) < size)
+      throw(std::string("Truncated service message."));
+    vec.resize(size);
+    memcpy(vec.data(), buf.data() + pos, size*sizeof(T));
+    pos += size*sizeof(T);
+  }
+
+  static void _checkMagic(const std::string& buf, size_t& pos, const char* magic) {
+    if (buf.size() - pos < 4 || memcmp(buf.data() + pos, magic, 4) != 0)
+      throw(std::string("Not a contraction optimizer service message."));
+    pos += 4;
+  }
+
+  static void _putCost(std::string& buf, const ContractionCost& cost) {
+    _putVector(buf, cost.getCostArray());
+    _putValue(buf, uint32_t(cost.getMaxIntermediateRank()));
+  }
+
+  static ContractionCost _getCost(const std::string& buf, size_t& pos) {
+    std::vector<unsigned int> store;
+    uint32_t maxIntermediateRank;
+    _getVector(buf, pos, store);
+    _getValue(buf, pos, maxIntermediateRank);
+    return ContractionCost(std::move(store), maxIntermediateRank);
+  }
+
+    // the icode of a graph from a client is only used if it is one that
+    // Graph encodes itself: sorted entries, one per pair of tensors with
+    // tens1 < tens2 < nTens and at least one contraction, and every index
+    // of every tensor contracted exactly once, the indices of a tensor
+    // being 0 ... rank-1; fills in the ranks of the tensors
+  static bool _checkGraphCode(const std::vector<unsigned int>& icode, size_t nTens,
+			      std::vector<uint>& rankList) {
+    if (icode.empty() || nTens > 16) return false;
+
+    unsigned int indMask[16] = {};
+    bool pairSeen[256] = {};
+    for (size_t iCode = 0; iCode < icode.size(); ++iCode) {
+      unsigned int aC = icode[iCode];
+      unsigned int tens1 = (aC >> 4) & 0xfu, tens2 = aC & 0xfu;
+      if ((iCode > 0 && icode[iCode-1] >= aC) || aC >> 29 != 0
+	  || tens1 >= tens2 || tens2 >= nTens || pairSeen[aC & 0xffu])
+	return false;
+      pairSeen[aC & 0xffu] = true;
+
+      bool hasContraction = false;
+      for (unsigned int ind1 = 0; ind1 < 7; ++ind1) {
+	unsigned int ind2PlOne = (aC >> (8 + 3*ind1)) & 0x7u;
+	if (ind2PlOne == 0) continue;
+	unsigned int bit1 = 1u << ind1, bit2 = 1u << (ind2PlOne - 1);
+	if ((indMask[tens1] & bit1) || (indMask[tens2] & bit2))
+	  return false;
+	indMask[tens1] |= bit1;
+	indMask[tens2] |= bit2;
+	hasContraction = true;
+      }
+      if (!hasContraction) return false;
+    }
+
+    rankList.resize(nTens);
+    for (size_t iTens = 0; iTens < nTens; ++iTens) {
+      if (indMask[iTens] == 0 || (indMask[iTens] & (indMask[iTens] + 1)) != 0)
+	return false;
+      rankList[iTens] = __builtin_popcount(indMask[iTens]);
+    }
+    return true;
+  }
+
+  static std::string _encodeError(const std::string& message) {
+    std::string buf(replyMagic, 4);
+    _putValue(buf, uint32_t(1));
+    _putValue(buf, uint32_t(message.size()));
+    buf += message;
+    return buf;
+  }
+
+
+    // whole messages over a stream socket; reading returns false if the
+    // peer closed the connection before the first byte
+  static bool _readAll(int fd, char* data, size_t size) {
+    size_t nRead = 0;
+    while (nRead < size) {
+      ssize_t ret = read(fd, data + nRead, size - nRead);
+      if (ret < 0 && errno == EINTR) continue;
+      if (ret == 0 && nRead == 0) return false;
+      if (ret <= 0)
+	throw(std::string("Connection to the optimizer service lost."));
+      nRead += ret;
+    }
+    return true;
+  }
+
+  static void _writeAll(int fd, const char* data, size_t size) {
+    size_t nWritten = 0;
+    while (nWritten < size) {
+      ssize_t ret = send(fd, data + nWritten, size - nWritten, MSG_NOSIGNAL);
+      if (ret < 0 && errno == EINTR) continue;
+      if (ret <= 0)
+	throw(std::string("Connection to the optimizer service lost."));
+      nWritten += ret;
+    }
+  }
+
+  static bool _readMessage(int fd, std::string& message) {
+    uint64_t size;
+    if (!_readAll(fd, reinterpret_cast<char*>(&size), sizeof(size))) return false;
+    if (size > maxMessageSize)
+      throw(std::string("Service message too large."));
+    message.resize(size);
+    if (size > 0 && !_readAll(fd, &message[0], size))
+      throw(std::string("Connection to the optimizer service lost."));
+    return true;
+  }
+
+  static void _writeMessage(int fd, const std::string& message) {
+    uint64_t size = message.size();
+    _writeAll(fd, reinterpret_cast<const char*>(&size), sizeof(size));
+    _writeAll(fd, message.data(), message.size());
+  }
+
+  static sockaddr_un _getAddress(const std::string& socketPath) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(addr.sun_path))
+      throw(std::string("Invalid socket path ") + socketPath);
+    strcpy(addr.sun_path, socketPath.c_str());
+    return addr;
+  }
+
+  static int _connect(const std::string& socketPath) {
+    sockaddr_un addr = _getAddress(socketPath);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      throw(std::string("Cannot create socket."));
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+      close(fd);
+      throw(std::string("Cannot connect to ") + socketPath);
+    }
+    return fd;
+  }
+
+
+  /*
+   *
+   * 	OptimizerService implementation
+   *
+   */
+
+
+  OptimizerService::OptimizerService(const std::string& _socketPath, uint _maxWorkers) :
+    	socketPath(_socketPath), listenFd(-1), stopRequested(false), nConnections(0),
+	maxCacheEntries(1ul << 22), maxWorkers(_maxWorkers), curDil(0), nDilUsers(0),
+	nTicketsIssued(0), nTicketsServed(0) {
+
+    if (maxWorkers == 0)
+      maxWorkers = std::max(1u, std::thread::hardware_concurrency());
+    maxConnections = 2*maxWorkers;
+
+    sockaddr_un addr = _getAddress(socketPath);
+
+      // a socket file left behind by a service that is gone is replaced,
+      // anything else is not touched
+    struct stat fileStat;
+    if (lstat(socketPath.c_str(), &fileStat) == 0) {
+      if (!S_ISSOCK(fileStat.st_mode))
+	throw(socketPath + std::string(" exists and is not a socket."));
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      bool inUse = (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+      if (fd >= 0) close(fd);
+      if (inUse)
+	throw(std::string("Another service is listening on ") + socketPath);
+      unlink(socketPath.c_str());
+    }
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0)
+      throw(std::string("Cannot create socket."));
+    if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+	|| listen(listenFd, SOMAXCONN) != 0) {
+      close(listenFd);
+      throw(std::string("Cannot listen on ") + socketPath);
+    }
+  }
+
+  OptimizerService::~OptimizerService() {
+    close(listenFd);
+    unlink(socketPath.c_str());
+  }
+
+  void OptimizerService::run() {
+    while (!stopRequested) {
+	// wait for a free connection slot; stop() may come from a signal
+	// handler, which cannot notify, so look at stopRequested now and then
+      {
+	std::unique_lock<std::mutex> lock(connectionMutex);
+	while (nConnections >= maxConnections && !stopRequested)
+	  connectionCond.wait_for(lock, std::chrono::milliseconds(100));
+      }
+      if (stopRequested) break;
+
+      int fd = accept(listenFd, nullptr, nullptr);
+      if (fd < 0) {
+	if (errno == EINTR || errno == ECONNABORTED) continue;
+	break;
+      }
+
+      {
+	std::lock_guard<std::mutex> lock(connectionMutex);
+	++nConnections;
+      }
+      std::thread(&OptimizerService::_serveConnection, this, fd).detach();
+    }
+
+    std::unique_lock<std::mutex> lock(connectionMutex);
+    connectionCond.wait(lock, [this] { return nConnections == 0; });
+  }
+
+  void OptimizerService::stop() {
+      // wakes up accept() in run()
+    stopRequested = true;
+    shutdown(listenFd, SHUT_RDWR);
+  }
+
+
+  void OptimizerService::_serveConnection(int fd) {
+    try {
+      std::string message;
+      while (_readMessage(fd, message))
+	_writeMessage(fd, _handleRequest(message));
+    }
+    catch (const std::string& err) {
+	// the client is gone or sent garbage, drop the connection
+    }
+    catch (const std::exception& err) {}
+    close(fd);
+
+    std::lock_guard<std::mutex> lock(connectionMutex);
+    --nConnections;
+    connectionCond.notify_all();
+  }
+
+  std::string OptimizerService::_handleRequest(const std::string& message) {
+    try {
+      size_t pos = 0;
+      _checkMagic(message, pos, requestMagic);
+
+      uint32_t nDil, maxRank, flags, nDiags;
+      uint64_t memoryBudget;
+      _getValue(message, pos, nDil);
+      _getValue(message, pos, maxRank);
+      _getValue(message, pos, memoryBudget);
+      _getValue(message, pos, flags);
+      _getValue(message, pos, nDiags);
+      if (nDil == 0)
+	throw(std::string("Must set dilution range first."));
+
+      std::vector<Diagram> diagList;
+      diagList.reserve(std::min<size_t>(nDiags, message.size() / 16));
+      std::map<uint, uint> rankMap;
+      std::vector<uint> rankList;
+      for (uint32_t iDiag = 0; iDiag < nDiags; ++iDiag) {
+	std::vector<unsigned int> icode;
+	std::vector<uint> tensIdList;
+	uint32_t correlatorId;
+	double weight;
+	_getVector(message, pos, icode);
+	_getVector(message, pos, tensIdList);
+	_getValue(message, pos, correlatorId);
+	_getValue(message, pos, weight);
+
+	  // the local tensor IDs of the graph must be 0 ... nTens-1, and a
+	  // tensor must have the same rank in every diagram
+	if (!_checkGraphCode(icode, tensIdList.size(), rankList))
+	  throw(std::string("Diagram ") + std::to_string(iDiag)
+		+ " is not a valid graph with one tensor ID per tensor.");
+	if (!std::isfinite(weight))
+	  throw(std::string("Diagram ") + std::to_string(iDiag) + " has a weight that is not finite.");
+	for (size_t iTens = 0; iTens < tensIdList.size(); ++iTens)
+	  if (tensIdList[iTens] >= maxInputTensId)
+	    throw(std::string("Tensor ID ") + std::to_string(tensIdList[iTens])
+		  + " is out of range, input IDs must be below " + std::to_string(maxInputTensId) + ".");
+	  else if (rankMap.emplace(tensIdList[iTens], rankList[iTens]).first->second != rankList[iTens])
+	    throw(std::string("Tensor ") + std::to_string(tensIdList[iTens])
+		  + " has different ranks in different diagrams.");
+	diagList.push_back(Diagram(Graph(std::move(icode)), std::move(tensIdList)));
+	diagList.back().setCorrelator(correlatorId, weight);
+      }
+      if (pos != message.size())
+	throw(std::string("Trailing data in service request."));
+
+      ContractionOptimizer cOp(std::move(diagList));
+      cOp.setVerbose(false);
+      cOp.setMaxIntermediateRank(maxRank);
+      cOp.setMemoryBudget(memoryBudget);
+      cOp.setPermutationCSE(flags & 0x1u);
+      cOp.setFactorisation(flags & 0x2u);
+      cOp.setUseDiagramStore(flags & 0x4u);
+
+      _acquireDilution(nDil);
+      try {
+	cOp.tune();
+      }
+      catch (...) {
+	_releaseDilution();
+	throw;
+      }
+      _releaseDilution();
+
+      std::string reply(replyMagic, 4);
+      _putValue(reply, uint32_t(0));
+      _putValue(reply, cOp.getTuneReport().tuneTime);
+      _putCost(reply, cOp.getCSECost());
+      _putCost(reply, cOp.getNoCSECost());
+      _putCost(reply, cOp.getAccumulateCost());
+
+      _putValue(reply, uint32_t(cOp.getCompStepList().size()));
+      for (const auto& aStep : cOp.getCompStepList()) {
+	_putValue(reply, uint32_t(std::get<0>(aStep)));
+	_putValue(reply, uint32_t(std::get<1>(aStep).first));
+	_putValue(reply, uint32_t(std::get<1>(aStep).second));
+	_putValue(reply, uint32_t(std::get<2>(aStep)));
+      }
+      _putVector(reply, cOp.getCoefficientList());
+
+      _putValue(reply, uint32_t(cOp.getTensorRankMap().size()));
+      for (auto rIt : cOp.getTensorRankMap()) {
+	_putValue(reply, uint32_t(rIt.first));
+	_putValue(reply, uint32_t(rIt.second));
+      }
+
+      _putValue(reply, uint32_t(cOp.getDiagramList().size()));
+      for (const auto& aDiag : cOp.getDiagramList())
+	_putVector(reply, aDiag.getResultIdList());
+      return reply;
+    }
+    catch (const std::string& err) {
+      return _encodeError(err);
+    }
+    catch (const std::exception& err) {
+      return _encodeError(err.what());
+    }
+  }
+
+
+    // tuning reads the dilution range only through the global setting, so
+    // requests share it if they agree and wait for each other otherwise;
+    // at most maxWorkers of them are tuned at a time. Requests are admitted
+    // in the order of their tickets, so a request with another range is not
+    // overtaken by a stream of requests with the current one
+  void OptimizerService::_acquireDilution(uint nDil) {
+    std::unique_lock<std::mutex> lock(dilutionMutex);
+    size_t ticket = nTicketsIssued++;
+    dilutionCond.wait(lock, [this, nDil, ticket] {
+	return ticket == nTicketsServed
+	  && (nDilUsers == 0 || (curDil == nDil && nDilUsers < maxWorkers)); });
+    nTicketsServed++;
+    if (nDilUsers++ == 0) {
+      curDil = nDil;
+      ContractionCost::setDilutionRange(nDil);
+    }
+      // the next ticket may be admitted as well
+    dilutionCond.notify_all();
+  }
+
+    // the caches are only emptied while no request is tuned, and the lock
+    // keeps new ones from starting meanwhile
+  void OptimizerService::_releaseDilution() {
+    std::lock_guard<std::mutex> lock(dilutionMutex);
+    if (--nDilUsers == 0 && Graph::getCacheSize() > maxCacheEntries)
+      Graph::clearCaches();
+    dilutionCond.notify_all();
+  }
+
+
+  ServiceReply OptimizerService::submit(const std::string& socketPath,
+					const ServiceRequest& aRequest) {
+    std::string message(requestMagic, 4);
+    _putValue(message, uint32_t(aRequest.nDil));
+    _putValue(message, uint32_t(aRequest.maxRank));
+    _putValue(message, uint64_t(aRequest.memoryBudget));
+    _putValue(message, uint32_t((aRequest.usePermutationCSE ? 0x1u : 0u)
+				| (aRequest.useFactorisation ? 0x2u : 0u)
+				| (aRequest.useDiagramStore ? 0x4u : 0u)));
+    _putValue(message, uint32_t(aRequest.diagList.size()));
+    for (const auto& aDiag : aRequest.diagList) {
+      _putVector(message, aDiag.getGraph().__hash__());
+      _putVector(message, aDiag.getRemainingTensors());
+      _putValue(message, uint32_t(aDiag.getCorrelatorId()));
+      _putValue(message, aDiag.getWeight());
+    }
+
+    int fd = _connect(socketPath);
+    std::string replyMessage;
+    try {
+      _writeMessage(fd, message);
+      if (!_readMessage(fd, replyMessage))
+	throw(std::string("Connection to the optimizer service lost."));
+    }
+    catch (...) {
+      close(fd);
+      throw;
+    }
+    close(fd);
+
+    size_t pos = 0;
+    _checkMagic(replyMessage, pos, replyMagic);
+    uint32_t status;
+    _getValue(replyMessage, pos, status);
+    if (status != 0) {
+      uint32_t size;
+      _getValue(replyMessage, pos, size);
+      if (replyMessage.size() - pos < size)
+	throw(std::string("Truncated service message."));
+      throw(replyMessage.substr(pos, size));
+    }
+
+    ServiceReply aReply;
+    _getValue(replyMessage, pos, aReply.tuneTime);
+    aReply.CSECost = _getCost(replyMessage, pos);
+    aReply.noCSECost = _getCost(replyMessage, pos);
+    aReply.accumulateCost = _getCost(replyMessage, pos);
+
+    uint32_t nSteps;
+    _getValue(replyMessage, pos, nSteps);
+    for (uint32_t iStep = 0; iStep < nSteps; ++iStep) {
+      uint32_t stepCode, tens1, tens2, newId;
+      _getValue(replyMessage, pos, stepCode);
+      _getValue(replyMessage, pos, tens1);
+      _getValue(replyMessage, pos, tens2);
+      _getValue(replyMessage, pos, newId);
+      aReply.compStepList.push_back(compStep_t(stepCode, iTup(tens1, tens2), newId));
+    }
+    _getVector(replyMessage, pos, aReply.coefficientList);
+
+    uint32_t nTens;
+    _getValue(replyMessage, pos, nTens);
+    for (uint32_t iTens = 0; iTens < nTens; ++iTens) {
+      uint32_t tensId, rank;
+      _getValue(replyMessage, pos, tensId);
+      _getValue(replyMessage, pos, rank);
+      aReply.tensRankMap[tensId] = rank;
+    }
+
+    uint32_t nDiags;
+    _getValue(replyMessage, pos, nDiags);
+    if ((replyMessage.size() - pos) / sizeof(uint32_t) < nDiags)
+      throw(std::string("Truncated service message."));
+    aReply.resultIdList.resize(nDiags);
+    for (auto& resultIds : aReply.resultIdList)
+      _getVector(replyMessage, pos, resultIds);
+    return aReply;
+  }
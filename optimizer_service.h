@@ -0,0 +1,129 @@
+#ifndef OPTIMIZER_SERVICE_H
+#define OPTIMIZER_SERVICE_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "contraction_optimizer.h"
+
+
+
+  // a batch of diagrams to tune, with the settings of the optimizer
+struct ServiceRequest {
+  uint nDil;
+  uint maxRank;			// see ContractionOptimizer::setMaxIntermediateRank
+  uint64_t memoryBudget;	// see ContractionOptimizer::setMemoryBudget
+  bool usePermutationCSE, useFactorisation, useDiagramStore;
+  std::vector<Diagram> diagList;
+
+  ServiceRequest() : nDil(0), maxRank(0), memoryBudget(0), usePermutationCSE(false),
+		     useFactorisation(false), useDiagramStore(false) {}
+};
+
+  // the tuned plan: steps and accumulation coefficients as in
+  // ContractionOptimizer, and the result IDs of every diagram of the request
+struct ServiceReply {
+  std::vector<compStep_t> compStepList;
+  std::vector<double> coefficientList;
+  std::vector<std::vector<uint>> resultIdList;
+  std::map<uint, uint> tensRankMap;
+  ContractionCost CSECost, noCSECost, accumulateCost;
+  double tuneTime;
+
+  ServiceReply() : tuneTime(0.) {}
+};
+
+
+  // Long-lived optimizer on a Unix domain socket, so that many small tuning
+  // jobs on a node share warm graph caches instead of building them anew in
+  // every process. Every connection is served by a thread of its own and
+  // may send any number of requests, answered in order. Messages in both
+  // directions are a uint64 length followed by that many bytes, all
+  // numbers in host byte order:
+  // 	request: "CORQ", nDil, maxRank, memoryBudget (uint64), flags
+  // 		(bit 0: permutation CSE, 1: factorisation, 2: diagram
+  // 		store), nDiags, then per diagram the icode of its graph
+  // 		(Graph::__hash__) as count and entries, its tensor IDs as
+  // 		count and entries, its correlator ID and weight (double)
+  // 	reply: "CORP", status (0: ok), then either an error message as
+  // 		length and characters, or tuneTime (double), CSECost,
+  // 		noCSECost and accumulateCost, each as count, entries and
+  // 		maximal intermediate rank, the steps as
+  // 		count and (code, tensor 1, tensor 2, new ID) each, the
+  // 		coefficients as count and doubles, the tensor ranks as count
+  // 		and (ID, rank) pairs, and the result IDs of every diagram as
+  // 		count and entries
+  // All other numbers are uint32; messages above 1 GiB are refused. A
+  // request is answered with an error unless every icode is one Graph
+  // would encode itself, every tensor ID is below 2^31 and has the same
+  // rank throughout, and every weight is finite.
+  // Requests with different dilution ranges are not tuned at the same
+  // time, since the range is a global setting, and at most maxWorkers
+  // requests are tuned at once; waiting requests are admitted in the order
+  // they arrived. At most maxConnections connections are served at once,
+  // further clients wait in the listen backlog, so that at most that many
+  // requests are buffered. Whenever no request is being tuned and the
+  // graph caches hold more than maxCacheEntries entries, they are emptied.
+class OptimizerService {
+
+  private:
+    std::string socketPath;
+    int listenFd;
+    std::atomic<bool> stopRequested;
+      // number of connections being served
+    std::mutex connectionMutex;
+    std::condition_variable connectionCond;
+    uint nConnections;
+      // keeps the graph caches alive between requests
+    GraphCacheHandle cacheHandle;
+
+      // bounds on the connections served at once and on the cache entries
+      // kept between requests
+    uint maxConnections;
+    size_t maxCacheEntries;
+
+      // dilution range of the requests being tuned, the bound on their
+      // number and their number; waiting requests draw tickets and are
+      // admitted in ticket order
+    std::mutex dilutionMutex;
+    std::condition_variable dilutionCond;
+    uint maxWorkers, curDil, nDilUsers;
+    size_t nTicketsIssued, nTicketsServed;
+
+  public:
+      // binds to socketPath, replacing a stale socket file; with maxWorkers
+      // 0 as many requests are tuned at once as there are hardware threads
+    OptimizerService(const std::string& _socketPath, uint _maxWorkers = 0);
+    ~OptimizerService();
+
+      // to be called before run(); the defaults are twice maxWorkers
+      // connections and 2^22 cache entries, of the order of 1 GiB
+    void setMaxConnections(uint _maxConnections) { maxConnections = std::max(_maxConnections, 1u); }
+    void setMaxCacheEntries(size_t _maxCacheEntries) { maxCacheEntries = _maxCacheEntries; }
+
+      // serves connections until stop() is called, then waits for the open
+      // connections to be closed by their clients
+    void run();
+      // may be called from any thread or a signal handler
+    void stop();
+
+      // sends a request to the service at socketPath and waits for the
+      // reply; errors of the service are thrown like local ones
+    static ServiceReply submit(const std::string& socketPath, const ServiceRequest& aRequest);
+
+  private:
+    void _serveConnection(int fd);
+    std::string _handleRequest(const std::string& message);
+    void _acquireDilution(uint nDil);
+    void _releaseDilution();
+};
+
+
+
+
+// ***************************************************************
+#endif
@@ -0,0 +1,277 @@
+#include "plan_executor.h"
+
+#include <string>
+#include <algorithm>
+#include <set>
+
+
+using namespace std;
+
+
+  /*
+   *
+   * 	PlanExecutor implementation
+   *
+   */
+
+
+  PlanExecutor::PlanExecutor(const ContractionOptimizer& _cOp) :
+    	cOp(_cOp), nDil(ContractionCost::getDilutionRange()), maxPackedSize(1ul << 22) {
+
+    if (nDil == 0)
+      throw(std::string("Must set dilution range first."));
+
+      // dependency level of every tensor produced by the plan, input tensors
+      // are not listed and have level 0
+    map<uint, uint> levelMap;
+    auto getLevel = [&levelMap] (uint tensId) {
+      auto lIt = levelMap.find(tensId);
+      return (lIt == levelMap.end()) ? 0u : lIt->second;
+    };
+
+      // (level, kernel) -> steps of the batch, as operand IDs and as steps
+    map<pair<uint, uint>, vector<array<uint, 3>>> batchMap;
+    map<pair<uint, uint>, vector<compStep_t>> stepMap;
+
+    for (const auto& aStep : cOp.getCompStepList()) {
+      const iTup& globTensPair = std::get<1>(aStep);
+      uint newId = std::get<2>(aStep);
+
+      if (ContractionOptimizer::getStepKind(std::get<0>(aStep)) == stepPermute) {
+	viewMap[newId] = std::make_pair(globTensPair.first, std::get<0>(aStep));
+	levelMap[newId] = getLevel(globTensPair.first);
+	continue;
+      }
+
+	// an accumulation target is complete one level above its deepest
+	// term; accumulations form batches of their own
+      if (ContractionOptimizer::getStepKind(std::get<0>(aStep)) == stepAccumulate) {
+	uint op = _resolveView(globTensPair.first);
+	uint level = getLevel(op) + 1;
+	levelMap[newId] = std::max(getLevel(newId), level);
+	batchMap[std::make_pair(level, accumulateKernel)].push_back({op, std::get<0>(aStep), newId});
+	stepMap[std::make_pair(level, accumulateKernel)].push_back(aStep);
+	continue;
+      }
+
+      uint op1 = _resolveView(globTensPair.first), op2 = _resolveView(globTensPair.second);
+      uint level = std::max(getLevel(op1), getLevel(op2)) + 1;
+      levelMap[newId] = level;
+
+      uint kernelId = _getKernel(aStep);
+      batchMap[std::make_pair(level, kernelId)].push_back({op1, op2, newId});
+      stepMap[std::make_pair(level, kernelId)].push_back(aStep);
+    }
+
+      // batches in order of level
+    set<uint> targetSet;
+    for (auto& bIt : batchMap) {
+      batch_t aBatch{bIt.first.second, std::move(bIt.second), {}};
+      if (aBatch.kernelId == accumulateKernel)
+	for (const auto& ops : aBatch.stepList)
+	  if (targetSet.insert(ops[2]).second) aBatch.zeroList.push_back(ops[2]);
+      batchList.push_back(std::move(aBatch));
+      schedule.push_back(std::move(stepMap.at(bIt.first)));
+    }
+  }
+
+  uint PlanExecutor::_resolveView(uint tensId) const {
+    auto vIt = viewMap.find(tensId);
+    return (vIt == viewMap.end()) ? tensId : vIt->second.first;
+  }
+
+  unsigned long PlanExecutor::getTensorSize(uint tensId) const {
+    unsigned long ret = 1;
+    for (uint iI = 0; iI < cOp.getTensorRank(tensId); ++iI) ret *= nDil;
+    return ret;
+  }
+
+
+    // row-major strides of a tensor of rank nInds, or of a permuted view on
+    // such a tensor if permCode is a stepPermute code
+  static vector<unsigned long> _getStrides(uint nInds, uint nDil, uint permCode) {
+    vector<unsigned long> strides(nInds, 1);
+    for (int iI = int(nInds) - 2; iI >= 0; --iI)
+      strides[iI] = strides[iI+1]*nDil;
+
+    if (permCode == 0) return strides;
+
+    vector<unsigned long> viewStrides;
+    for (auto aInd : ContractionOptimizer::decodePermutation(permCode, nInds))
+      viewStrides.push_back(strides[aInd]);
+    return viewStrides;
+  }
+
+    // offsets of all multi-indices over the given strides, row-major
+  static vector<unsigned long> _getOffsets(const vector<unsigned long>& strides, uint nDil) {
+    vector<unsigned long> ret(1, 0);
+    for (auto aStride : strides) {
+      vector<unsigned long> next;
+      next.reserve(ret.size()*nDil);
+      for (auto aOff : ret)
+	for (uint iD = 0; iD < nDil; ++iD)
+	  next.push_back(aOff + iD*aStride);
+      ret.swap(next);
+    }
+    return ret;
+  }
+
+  uint PlanExecutor::_getKernel(const compStep_t& aStep) {
+    const iTup& globTensPair = std::get<1>(aStep);
+    auto vIt1 = viewMap.find(globTensPair.first), vIt2 = viewMap.find(globTensPair.second);
+    stepShape_t shape(std::get<0>(aStep),
+		      cOp.getTensorRank(globTensPair.first),
+		      cOp.getTensorRank(globTensPair.second),
+		      (vIt1 == viewMap.end()) ? 0 : vIt1->second.second,
+		      (vIt2 == viewMap.end()) ? 0 : vIt2->second.second);
+
+    auto kIt = kernelMap.find(shape);
+    if (kIt != kernelMap.end()) return kIt->second;
+
+    uint stepCode, nInds1, nInds2, permCode1, permCode2;
+    std::tie(stepCode, nInds1, nInds2, permCode1, permCode2) = shape;
+    auto strides1 = _getStrides(nInds1, nDil, permCode1),
+	 strides2 = _getStrides(nInds2, nDil, permCode2);
+
+      // split the strides of both operands into free and contracted ones
+    vector<unsigned long> freeStrides1, freeStrides2, contrStrides1, contrStrides2;
+    vector<bool> isContr1(nInds1, false), isContr2(nInds2, false);
+    for (auto cIt : Graph::decodeElement(stepCode)) {
+      contrStrides1.push_back(strides1[cIt.first]);
+      contrStrides2.push_back(strides2[cIt.second]);
+      isContr1[cIt.first] = isContr2[cIt.second] = true;
+    }
+    for (uint iI = 0; iI < nInds1; ++iI)
+      if (!isContr1[iI]) freeStrides1.push_back(strides1[iI]);
+    for (uint iI = 0; iI < nInds2; ++iI)
+      if (!isContr2[iI]) freeStrides2.push_back(strides2[iI]);
+
+    kernel_t aKernel;
+    aKernel.offM1 = _getOffsets(freeStrides1, nDil);
+    aKernel.offK1 = _getOffsets(contrStrides1, nDil);
+    aKernel.offK2 = _getOffsets(contrStrides2, nDil);
+    aKernel.offN2 = _getOffsets(freeStrides2, nDil);
+    aKernel.M = aKernel.offM1.size();
+    aKernel.K = aKernel.offK1.size();
+    aKernel.N = aKernel.offN2.size();
+
+    kernelList.push_back(std::move(aKernel));
+    kernelMap.emplace(shape, kernelList.size() - 1);
+    return kernelList.size() - 1;
+  }
+
+
+  void PlanExecutor::_runBatch(const batch_t& aBatch, double* const* tens) {
+    if (aBatch.kernelId == accumulateKernel) {
+      for (const auto& ops : aBatch.stepList) {
+	const double* __restrict__ t = tens[ops[0]];
+	double* __restrict__ res = tens[ops[2]];
+	const double coeff = cOp.getCoefficient(ops[1]);
+	const unsigned long n = 2*getTensorSize(ops[2]);
+	for (unsigned long iR = 0; iR < n; ++iR)
+	  res[iR] += coeff*t[iR];
+      }
+      return;
+    }
+
+    const kernel_t& kern = kernelList[aBatch.kernelId];
+    const unsigned long M = kern.M, K = kern.K, N = kern.N;
+    const unsigned long sizeA = M*K, sizeB = K*N;
+
+      // number of steps packed at once
+    size_t nChunk = std::max<size_t>(1, maxPackedSize / (2*(sizeA + sizeB)));
+    nChunk = std::min(nChunk, aBatch.stepList.size());
+    packA.resize(2*sizeA*nChunk);
+    packB.resize(2*sizeB*nChunk);
+    rowBuf.resize(2*N);
+    double* __restrict__ rowRe = rowBuf.data();
+    double* __restrict__ rowIm = rowRe + N;
+
+    for (size_t iFirst = 0; iFirst < aBatch.stepList.size(); iFirst += nChunk) {
+      size_t nCur = std::min(nChunk, aBatch.stepList.size() - iFirst);
+
+	// pack operands in split re/im matrices: the real parts of step iS
+	// start at 2*iS*size, the imaginary parts follow
+      for (size_t iS = 0; iS < nCur; ++iS) {
+	const auto& ops = aBatch.stepList[iFirst + iS];
+	const double* t1 = tens[ops[0]];
+	const double* t2 = tens[ops[1]];
+	double* aRe = &packA[2*iS*sizeA];
+	double* aIm = aRe + sizeA;
+	double* bRe = &packB[2*iS*sizeB];
+	double* bIm = bRe + sizeB;
+
+	for (unsigned long iM = 0; iM < M; ++iM)
+	  for (unsigned long iK = 0; iK < K; ++iK) {
+	    unsigned long off = 2*(kern.offM1[iM] + kern.offK1[iK]);
+	    aRe[iM*K+iK] = t1[off];
+	    aIm[iM*K+iK] = t1[off+1];
+	  }
+	for (unsigned long iK = 0; iK < K; ++iK)
+	  for (unsigned long iN = 0; iN < N; ++iN) {
+	    unsigned long off = 2*(kern.offK2[iK] + kern.offN2[iN]);
+	    bRe[iK*N+iN] = t2[off];
+	    bIm[iK*N+iN] = t2[off+1];
+	  }
+      }
+
+	// batched complex matrix product, written straight to the results
+      for (size_t iS = 0; iS < nCur; ++iS) {
+	const double* __restrict__ aRe = &packA[2*iS*sizeA];
+	const double* __restrict__ aIm = aRe + sizeA;
+	const double* __restrict__ bRe = &packB[2*iS*sizeB];
+	const double* __restrict__ bIm = bRe + sizeB;
+	double* __restrict__ res = tens[aBatch.stepList[iFirst + iS][2]];
+
+	if (N == 1) {
+	    // matrix-vector product, reduce over contiguous k
+	  for (unsigned long iM = 0; iM < M; ++iM) {
+	    double cRe = 0., cIm = 0.;
+	    for (unsigned long iK = 0; iK < K; ++iK) {
+	      cRe += aRe[iM*K+iK]*bRe[iK] - aIm[iM*K+iK]*bIm[iK];
+	      cIm += aRe[iM*K+iK]*bIm[iK] + aIm[iM*K+iK]*bRe[iK];
+	    }
+	    res[2*iM] = cRe;
+	    res[2*iM+1] = cIm;
+	  }
+	  continue;
+	}
+
+	  // accumulate one row of the result in split form, the inner loop
+	  // runs over contiguous n in both the packed operand and the row
+	for (unsigned long iM = 0; iM < M; ++iM) {
+	  std::fill(rowRe, rowRe + N, 0.);
+	  std::fill(rowIm, rowIm + N, 0.);
+	  for (unsigned long iK = 0; iK < K; ++iK) {
+	    const double a1 = aRe[iM*K+iK], a2 = aIm[iM*K+iK];
+	    const double* __restrict__ b1 = bRe + iK*N;
+	    const double* __restrict__ b2 = bIm + iK*N;
+	    for (unsigned long iN = 0; iN < N; ++iN) {
+	      rowRe[iN] += a1*b1[iN] - a2*b2[iN];
+	      rowIm[iN] += a1*b2[iN] + a2*b1[iN];
+	    }
+	  }
+	  for (unsigned long iN = 0; iN < N; ++iN) {
+	    res[2*(iM*N+iN)] = rowRe[iN];
+	    res[2*(iM*N+iN)+1] = rowIm[iN];
+	  }
+	}
+      }
+    }
+  }
+
+
+  void PlanExecutor::execute(double* const* tens) {
+    for (const auto& aBatch : batchList) {
+      for (auto tensId : aBatch.zeroList)
+	std::fill(tens[tensId], tens[tensId] + 2*getTensorSize(tensId), 0.);
+      _runBatch(aBatch, tens);
+    }
+
+      // scalar views have storage of their own
+    for (auto vIt : viewMap)
+      if (cOp.getTensorRank(vIt.first) == 0) {
+	tens[vIt.first][0] = tens[vIt.second.first][0];
+	tens[vIt.first][1] = tens[vIt.second.first][1];
+      }
+  }
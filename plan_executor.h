@@ -0,0 +1,99 @@
+#ifndef PLAN_EXECUTOR_H
+#define PLAN_EXECUTOR_H
+
+#include <array>
+#include <vector>
+
+#include "contraction_optimizer.h"
+
+
+
+  // Evaluates a tuned plan at run time in batches. Steps are assigned a
+  // dependency level (one more than the deepest of their operands, input
+  // tensors being level 0); steps of the same level and the same shape --
+  // index pairs, operand ranks and operand permutations -- form one batch.
+  //
+  // Every step is a complex matrix product res[m,n] = sum_k t1[m,k] t2[k,n],
+  // m running over the free indices of the first tensor, n over those of the
+  // second and k over the contracted pairs. For a batch the operands of all
+  // its steps are packed into contiguous split re/im matrices and multiplied
+  // in one batched kernel, so small steps do not pay per-call overhead.
+  //
+  // Storage conventions are those of CodeGenerator: tensors are row-major
+  // arrays of interleaved double precision complex numbers, and permuted
+  // views (stepPermute) are read from the underlying tensor. Accumulations
+  // (stepAccumulate) are batched by level like contractions, the level of
+  // their target being that of its last term; a target is zeroed by the
+  // batch accumulating into it first.
+class PlanExecutor {
+
+  private:
+      // (step code, rank of first tensor, rank of second tensor,
+      //  permutation step codes of the operands, 0 if not a view)
+    typedef std::tuple<uint, uint, uint, uint, uint> stepShape_t;
+
+      // matrix form of a step shape: element (m,k) of the first operand is
+      // at offset offM1[m] + offK1[k] of the tensor, (k,n) of the second at
+      // offK2[k] + offN2[n], counted in complex numbers
+    struct kernel_t {
+      unsigned long M, K, N;
+      std::vector<unsigned long> offM1, offK1, offK2, offN2;
+    };
+
+      // steps of one batch: IDs of the two operands and the result; for
+      // accumulations the ID of the term, the step code and the target
+      // zeroList names the accumulation targets first written by the batch
+    static constexpr uint accumulateKernel = ~0u;
+    struct batch_t {
+      uint kernelId;
+      std::vector<std::array<uint, 3>> stepList;
+      std::vector<uint> zeroList;
+    };
+
+    const ContractionOptimizer& cOp;
+    unsigned int nDil;
+    std::map<stepShape_t, uint> kernelMap;
+    std::vector<kernel_t> kernelList;
+    std::vector<batch_t> batchList;
+      // view ID -> (ID of the underlying tensor, permutation step code)
+    std::map<uint, std::pair<uint, uint>> viewMap;
+      // the steps of every batch, in order
+    std::vector<std::vector<compStep_t>> schedule;
+      // upper bound on the number of doubles packed at once
+    size_t maxPackedSize;
+      // packing buffers, reused between batches
+    std::vector<double> packA, packB, rowBuf;
+
+  public:
+    PlanExecutor(const ContractionOptimizer& _cOp);
+
+    const ContractionOptimizer& getOptimizer() const { return cOp; }
+    size_t getNumBatches() const { return batchList.size(); }
+    size_t getNumKernels() const { return kernelList.size(); }
+      // number of complex numbers to allocate for tensor tensId
+    unsigned long getTensorSize(uint tensId) const;
+      // the steps of the plan in the order of execution, grouped by batch,
+      // for a BufferPlan sharing storage between intermediaries
+    const std::vector<std::vector<compStep_t>>& getSchedule() const { return schedule; }
+
+      // limits the memory used for packing, batches larger than that are
+      // processed in chunks
+    void setMaxPackedSize(size_t nDoubles) { maxPackedSize = nDoubles; }
+
+      // evaluates the plan; tens[id] must point to the storage of tensor id
+      // for all input tensors, intermediaries and results, but not for views
+      // of rank > 0. Intermediaries may share storage as assigned by a
+      // BufferPlan on getSchedule()
+    void execute(double* const* tens);
+
+  private:
+    uint _getKernel(const compStep_t& aStep);
+    uint _resolveView(uint tensId) const;
+    void _runBatch(const batch_t& aBatch, double* const* tens);
+};
+
+
+
+
+// ***************************************************************
+#endif
@@ -0,0 +1,153 @@
+#include "streaming_executor.h"
+
+#include <algorithm>
+#include <set>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+using namespace std;
+
+
+  /*
+   *
+   * 	StreamingExecutor implementation
+   *
+   */
+
+
+  StreamingExecutor::StreamingExecutor(PlanExecutor& _pExec) :
+    	pExec(_pExec), cOp(_pExec.getOptimizer()),
+	bufferPlan(_pExec.getOptimizer(), _pExec.getSchedule()) {}
+
+  StreamingExecutor::~StreamingExecutor() {
+    for (const auto& aFile : fileList)
+      munmap(const_cast<char*>(aFile.data), aFile.size);
+  }
+
+  vector<uint> StreamingExecutor::getInputIdList() const {
+    set<uint> producedIds;
+    for (const auto& aStep : cOp.getCompStepList())
+      producedIds.insert(std::get<2>(aStep));
+
+    vector<uint> ret;
+    for (auto tIt : cOp.getTensorRankMap())
+      if (producedIds.find(tIt.first) == producedIds.end())
+	ret.push_back(tIt.first);
+    return ret;
+  }
+
+  uint StreamingExecutor::_mapFile(const std::string& fileName) {
+    auto fIt = fileIdMap.find(fileName);
+    if (fIt != fileIdMap.end()) return fIt->second;
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw(std::string("Cannot open ") + fileName);
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+      close(fd);
+      throw(std::string("Cannot map empty file ") + fileName);
+    }
+
+    void* data = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+      throw(std::string("Cannot map ") + fileName);
+
+      // the slices are read in order
+    madvise(data, fileStat.st_size, MADV_SEQUENTIAL);
+
+    fileList.push_back(mappedFile_t{static_cast<const char*>(data), size_t(fileStat.st_size)});
+    fileIdMap.emplace(fileName, fileList.size() - 1);
+    return fileList.size() - 1;
+  }
+
+  void StreamingExecutor::bindInput(uint tensId, const std::string& fileName,
+				    size_t offset, size_t sliceStride) {
+    if (offset % sizeof(double) != 0 || sliceStride % sizeof(double) != 0)
+      throw(std::string("Input regions must be aligned to double."));
+    if (cOp.getTensorRankMap().find(tensId) == cOp.getTensorRankMap().end())
+      throw(std::string("Tensor ") + std::to_string(tensId) + " does not occur in the plan.");
+
+    bindingMap[tensId] = binding_t{_mapFile(fileName), offset, sliceStride};
+  }
+
+  const double* StreamingExecutor::_getInput(const binding_t& aBinding, uint tensId,
+					     uint iSlice) const {
+    const mappedFile_t& aFile = fileList[aBinding.fileId];
+    size_t begin = aBinding.offset + iSlice*aBinding.sliceStride;
+    size_t nBytes = 2*sizeof(double)*pExec.getTensorSize(tensId);
+
+    if (begin + nBytes > aFile.size)
+      throw(std::string("Input tensor ") + std::to_string(tensId) + " of slice "
+	    + std::to_string(iSlice) + " exceeds its file.");
+
+    return reinterpret_cast<const double*>(aFile.data + begin);
+  }
+
+    // advises the kernel to read the inputs of slice iSlice and touches
+    // their pages, so that they are resident when the slice is contracted
+  void StreamingExecutor::_prefetch(uint iSlice) const {
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+
+    for (const auto& bIt : bindingMap) {
+      const char* begin = reinterpret_cast<const char*>(_getInput(bIt.second, bIt.first, iSlice));
+      const char* end = begin + 2*sizeof(double)*pExec.getTensorSize(bIt.first);
+      const char* pageBegin = fileList[bIt.second.fileId].data
+	+ (begin - fileList[bIt.second.fileId].data) / pageSize * pageSize;
+
+      madvise(const_cast<char*>(pageBegin), end - pageBegin, MADV_WILLNEED);
+
+      volatile char sink = 0;
+      for (const char* aPage = pageBegin; aPage < end; aPage += pageSize)
+	sink += *aPage;
+    }
+  }
+
+  void StreamingExecutor::run(uint nSlices,
+			      const std::function<void(uint, double* const*)>& processSlice) {
+    if (cOp.getTensorRankMap().empty())
+      throw(std::string("Must tune the plan first."));
+
+    auto inputIdList = getInputIdList();
+    for (auto tensId : inputIdList)
+      if (bindingMap.find(tensId) == bindingMap.end())
+	throw(std::string("Input tensor ") + std::to_string(tensId) + " is not bound.");
+    if (nSlices == 0) return;
+
+      // check the extent of all regions up front, the prefetch thread
+      // must not throw
+    for (const auto& bIt : bindingMap)
+      _getInput(bIt.second, bIt.first, nSlices - 1);
+
+      // storage for the tensors formed by the plan, one arena shared by
+      // intermediaries with disjoint lives and by all slices
+    uint maxId = cOp.getTensorRankMap().rbegin()->first;
+    vector<double*> tens(maxId + 1, nullptr);
+    vector<double> arena(2*bufferPlan.getArenaSize());
+    bufferPlan.bind(arena.data(), tens.data());
+
+      // the first slice is read synchronously, every further one while
+      // the previous slice is contracted
+    _prefetch(0);
+    for (uint iSlice = 0; iSlice < nSlices; ++iSlice) {
+      std::thread prefetchThread;
+      if (iSlice + 1 < nSlices)
+	prefetchThread = std::thread(&StreamingExecutor::_prefetch, this, iSlice + 1);
+
+	// the plan reads its inputs only, so the mapping can stay read-only
+      for (const auto& bIt : bindingMap)
+	tens[bIt.first] = const_cast<double*>(_getInput(bIt.second, bIt.first, iSlice));
+
+      pExec.execute(tens.data());
+
+      if (prefetchThread.joinable()) prefetchThread.join();
+      processSlice(iSlice, tens.data());
+    }
+  }
@@ -0,0 +1,78 @@
+#ifndef STREAMING_EXECUTOR_H
+#define STREAMING_EXECUTOR_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "plan_executor.h"
+#include "buffer_plan.h"
+
+
+
+  // Runs a PlanExecutor over many time slices with the input tensors read
+  // directly from memory-mapped files. Every input tensor ID of the plan is
+  // bound to a region of a file: for slice t its data -- interleaved double
+  // precision complex numbers, as for PlanExecutor -- starts at byte
+  //	offset + t*sliceStride
+  // and is passed to the plan without copying. While slice t is contracted,
+  // a helper thread prefetches the input pages of slice t+1.
+  // Intermediaries are allocated once, in one arena laid out by a
+  // BufferPlan on the schedule of the PlanExecutor, and reused for all
+  // slices.
+class StreamingExecutor {
+
+  private:
+    struct mappedFile_t {
+      const char* data;
+      size_t size;
+    };
+    struct binding_t {
+      uint fileId;
+      size_t offset, sliceStride;
+    };
+
+    PlanExecutor& pExec;
+    const ContractionOptimizer& cOp;
+    std::map<std::string, uint> fileIdMap;
+    std::vector<mappedFile_t> fileList;
+      // input tensor ID -> region in a mapped file
+    std::map<uint, binding_t> bindingMap;
+      // storage of the tensors formed by the plan
+    BufferPlan bufferPlan;
+
+  public:
+    StreamingExecutor(PlanExecutor& _pExec);
+    ~StreamingExecutor();
+
+    StreamingExecutor(const StreamingExecutor&) = delete;
+    StreamingExecutor& operator=(const StreamingExecutor&) = delete;
+
+      // IDs of the input tensors of the plan, all of which must be bound
+    std::vector<uint> getInputIdList() const;
+
+      // binds input tensor tensId to the region of file fileName given
+      // above; offset and sliceStride are in bytes
+    void bindInput(uint tensId, const std::string& fileName,
+		   size_t offset, size_t sliceStride);
+
+      // executes the plan for slices 0 to nSlices-1 and calls
+      // processSlice(t, tens) after slice t, tens[id] pointing to the
+      // storage of tensor id as in PlanExecutor::execute. Only the results
+      // of the diagrams are valid then, intermediaries share storage
+    void run(uint nSlices,
+	     const std::function<void(uint, double* const*)>& processSlice);
+
+    const BufferPlan& getBufferPlan() const { return bufferPlan; }
+
+  private:
+    uint _mapFile(const std::string& fileName);
+    const double* _getInput(const binding_t& aBinding, uint tensId, uint iSlice) const;
+    void _prefetch(uint iSlice) const;
+};
+
+
+
+
+// ***************************************************************
+#endif